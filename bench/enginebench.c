@@ -0,0 +1,333 @@
+/* enginebench.c
+This file is a part of 'candor'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+times the whole of libficus, rendered offline so no JACK server
+or soundcard is needed and every run plays the same audio:
+
+ process  - cost of a period with 0/8/24/48 preloaded banks
+            playing, each routed to 1, 2 or all channels
+ stream   - frames a second read from disk and played by 8
+	    streaming banks, forward, reverse and varispeed
+ prefetch - how long 8 streaming banks take to play through
+	    soundfiles that aren't in the page cache once,
+	    without and with readahead
+ capture  - frames a second written to disk per armed bank
+
+usage: enginebench [directory for scratch files] [period]
+prints one CSV line per measurement.
+
+Copyright 2014 murray foster */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sndfile.h>
+
+#include "libficus.h"
+
+#define NUM_SAMPLES 48
+#define NUM_CHANNELS 8
+#define SAMPLERATE 48000
+#define SOURCE_FRAMES 480000 /* 10 seconds, short enough to preload */
+#define RUN_NS 200000000.0 /* time spent on every measurement */
+
+static int period = 256;
+
+static double
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+} /* now_ns */
+
+static int
+write_source(char *path)
+{
+  /* a mono sine sweep every bank plays, the same every run */
+  SF_INFO sfinfo;
+  SNDFILE *sndfile;
+  float buf[1024];
+  int i, n;
+
+  memset(&sfinfo, 0, sizeof(sfinfo));
+  sfinfo.samplerate = SAMPLERATE;
+  sfinfo.channels = 1;
+  sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+  if( (sndfile = sf_open(path, SFM_WRITE, &sfinfo)) == NULL )
+    return 1;
+
+  for( n = 0; n < SOURCE_FRAMES; n += 1024 )
+    {
+      for( i = 0; i < 1024; i++ )
+	buf[i] = 0.25 * sin((n + i) * (n + i) * 1e-7);
+      sf_writef_float(sndfile, buf, 1024);
+    }
+
+  sf_close(sndfile);
+  return 0;
+} /* write_source */
+
+static void
+evict(char *path)
+{
+  /* drop a soundfile from the page cache, so the next read
+     of it has to go to the disk */
+  int fd;
+
+  if( (fd = open(path, O_RDONLY)) < 0 )
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+} /* evict */
+
+static void
+silence()
+{
+  /* stop every bank and let the engine catch up */
+  int bank;
+
+  for( bank = 0; bank < NUM_SAMPLES; bank++ )
+    ficus_killplayback(bank);
+  ficus_render(period * 4);
+} /* silence */
+
+static void
+start_banks(int banks, unsigned int mask, float speed)
+{
+  /* loop 'banks' banks, routed to the channels in 'mask' */
+  int bank, c;
+
+  for( bank = 0; bank < banks; bank++ )
+    {
+      for( c = 0; c < NUM_CHANNELS; c++ )
+	ficus_setmixout(bank, c, (mask >> c) & 1);
+      ficus_loop(bank, 1);
+      ficus_playback_speed(bank, speed);
+      ficus_playback(bank);
+    }
+} /* start_banks */
+
+static double
+measure(long *frames)
+{
+  /* render in chunks of 16 periods until RUN_NS has passed,
+     after a second to warm up caches and fill the queues */
+  double start, elapsed;
+
+  ficus_render(SAMPLERATE);
+
+  *frames = 0;
+  start = now_ns();
+  do
+    {
+      ficus_render(period * 16);
+      *frames += period * 16;
+      elapsed = now_ns() - start;
+    }
+  while( elapsed < RUN_NS );
+
+  return elapsed;
+} /* measure */
+
+static void
+report(char *bench, char *variant, int count, char *metric, double value)
+{
+  printf("%s,%s,%d,%d,%s,%.3f\n", bench, variant, count, period, metric, value);
+} /* report */
+
+static void
+bench_process()
+{
+  int counts[] = {0, 8, 24, 48};
+  unsigned int masks[] = {0x01, 0x09, 0xff};
+  char *routings[] = {"route1", "route2", "route8"};
+  double elapsed;
+  long frames;
+  int c, r;
+
+  for( r = 0; r < 3; r++ )
+    for( c = 0; c < 4; c++ )
+      {
+	start_banks(counts[c], masks[r], 1.0);
+	elapsed = measure(&frames);
+	report("process", routings[r], counts[c], "us_per_period",
+	       elapsed / 1000.0 / (frames / period));
+	report("process", routings[r], counts[c], "realtime_x",
+	       frames * 1e9 / SAMPLERATE / elapsed);
+	silence();
+      }
+} /* bench_process */
+
+static void
+bench_stream(char *source)
+{
+  float speeds[] = {1.0, -1.0, 1.5};
+  char *variants[] = {"forward", "reverse", "varispeed"};
+  double elapsed;
+  long frames;
+  int s, bank;
+
+  /* the same soundfile, this time streamed from disk */
+  for( bank = 0; bank < 8; bank++ )
+    {
+      ficus_preload(bank, FICUS_PRELOAD_OFF);
+      ficus_loadfile(source, bank);
+    }
+
+  for( s = 0; s < 3; s++ )
+    {
+      start_banks(8, 0x01, speeds[s]);
+      elapsed = measure(&frames);
+      report("stream", variants[s], 8, "frames_per_sec",
+	     8 * frames * fabs(speeds[s]) * 1e9 / elapsed);
+      report("stream", variants[s], 8, "realtime_x",
+	     frames * 1e9 / SAMPLERATE / elapsed);
+      silence();
+    }
+} /* bench_stream */
+
+static void
+bench_prefetch(char *dir)
+{
+  /* every run gets soundfiles of its own, fresh off the disk.
+     files that are mapped can't be evicted */
+  int frames_ahead[] = {0, 262144};
+  char *variants[] = {"off", "on"};
+  char path[256];
+  double start, elapsed;
+  int v, bank;
+
+  for( v = 0; v < 2; v++ )
+    {
+      ficus_prefetch(frames_ahead[v]);
+      for( bank = 0; bank < 8; bank++ )
+	{
+	  snprintf(path, sizeof(path), "%s/enginebench_cold%d.wav", dir, bank);
+	  write_source(path);
+	  evict(path);
+	  ficus_preload(bank, FICUS_PRELOAD_OFF);
+	  ficus_loadfile(path, bank);
+	}
+
+      /* only the first pass reads from the disk, after
+	 that the soundfiles are cached either way */
+      start_banks(8, 0x01, 1.0);
+      start = now_ns();
+      ficus_render(SOURCE_FRAMES);
+      elapsed = now_ns() - start;
+      report("prefetch", variants[v], 8, "ms_first_pass", elapsed / 1e6);
+      report("prefetch", variants[v], 8, "realtime_x",
+	     SOURCE_FRAMES * 1e9 / SAMPLERATE / elapsed);
+      silence();
+    }
+
+  for( bank = 0; bank < 8; bank++ )
+    {
+      snprintf(path, sizeof(path), "%s/enginebench_cold%d.wav", dir, bank);
+      unlink(path);
+    }
+} /* bench_prefetch */
+
+static void
+bench_capture(char *source)
+{
+  int counts[] = {1, 4, 8};
+  double elapsed;
+  long frames;
+  int c, bank, first = NUM_SAMPLES - 8;
+
+  /* captures listen to the source soundfile playing into
+     every input channel, and aren't kept in memory */
+  ficus_render_open(NULL, source);
+  for( bank = first; bank < NUM_SAMPLES; bank++ )
+    {
+      ficus_preload(bank, FICUS_PRELOAD_OFF);
+      ficus_setmixin(bank, (bank - first) % NUM_CHANNELS, 1);
+    }
+
+  for( c = 0; c < 3; c++ )
+    {
+      for( bank = first; bank < first + counts[c]; bank++ )
+	ficus_capturef(bank, 0);
+      elapsed = measure(&frames);
+      report("capture", "armed", counts[c], "frames_per_sec_per_bank",
+	     frames * 1e9 / elapsed);
+      report("capture", "armed", counts[c], "realtime_x",
+	     frames * 1e9 / SAMPLERATE / elapsed);
+
+      /* let the capture thread close the soundfiles */
+      for( bank = first; bank < first + counts[c]; bank++ )
+	ficus_killcapture(bank);
+      for( bank = first; bank < first + counts[c]; bank++ )
+	while( ficus_iscapturing(bank) )
+	  ficus_render(period);
+    }
+
+  ficus_render_close();
+} /* bench_capture */
+
+int
+main(int argc, char *argv[])
+{
+  char *dir = argc > 1 ? argv[1] : "/tmp";
+  char source[256];
+  int bank;
+
+  if( argc > 2 )
+    period = atoi(argv[2]);
+
+  snprintf(source, sizeof(source), "%s/enginebench.wav", dir);
+  if( write_source(source) )
+    {
+      fprintf(stderr, "enginebench: can't write %s\n", source);
+      return 1;
+    }
+
+  if( ficus_render_setup(dir, "enginebench", 24, NUM_SAMPLES,
+			 NUM_CHANNELS, SAMPLERATE, period) )
+    {
+      fprintf(stderr, "enginebench: can't set up libficus\n");
+      return 1;
+    }
+
+  for( bank = 0; bank < NUM_SAMPLES; bank++ )
+    {
+      ficus_preload(bank, FICUS_PRELOAD_ON);
+      ficus_loadfile(source, bank);
+    }
+
+  printf("bench,variant,count,period,metric,value\n");
+  bench_process();
+  bench_stream(source);
+  bench_prefetch(dir);
+  bench_capture(source);
+
+  ficus_clean();
+  for( bank = NUM_SAMPLES - 8; bank < NUM_SAMPLES; bank++ )
+    {
+      snprintf(source, sizeof(source), "%s/enginebench%d.wav", dir, bank);
+      unlink(source);
+    }
+  snprintf(source, sizeof(source), "%s/enginebench.wav", dir);
+  unlink(source);
+
+  return 0;
+} /* main */
@@ -0,0 +1,138 @@
+/* mixbench.c
+This file is a part of 'candor'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+times the output mixing stage of process(), the old per-frame
+loop over the playback_mix matrix against the block kernels
+in ficus/mixer.c.  every voice is routed to two of the eight
+channels.  prints one line per voice count/period size/kernel
+with the cost of a single period in microseconds.
+
+Copyright 2014 murray foster */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mixer.h"
+
+#define NUM_SAMPLES 48
+#define NUM_CHANNELS 8
+#define MAX_FRAMES 1024
+#define RUN_NS 200000000.0 /* time spent on every measurement */
+
+static float *outs[NUM_CHANNELS];
+static float voice[NUM_SAMPLES][MAX_FRAMES];
+static int playback_mix[NUM_SAMPLES][NUM_CHANNELS];
+static unsigned int playback_mask[NUM_SAMPLES];
+
+static double
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+} /* now_ns */
+
+static void
+period_matrix(int voices, int nframes)
+{
+  /* the way process() used to mix, every frame of every
+     bank checked against every channel */
+  int i, bank, n;
+
+  for( n = 0; n < NUM_CHANNELS; n++ )
+    memset(outs[n], 0, nframes * sizeof(float));
+
+  for( i = 0; i < nframes; i++ )
+    for( bank = 0; bank < voices; bank++ )
+      for( n = 0; n < NUM_CHANNELS; n++ )
+	if( playback_mix[bank][n] == 1 )
+	  outs[n][i] += voice[bank][i];
+} /* period_matrix */
+
+static void
+period_block(int voices, int nframes)
+{
+  int bank, n;
+
+  for( n = 0; n < NUM_CHANNELS; n++ )
+    memset(outs[n], 0, nframes * sizeof(float));
+
+  for( bank = 0; bank < voices; bank++ )
+    mixer_block(outs, playback_mask[bank], 0, voice[bank], nframes);
+} /* period_block */
+
+static double
+measure(void (*period)(int, int), int voices, int nframes)
+{
+  double start, elapsed;
+  long runs = 0;
+
+  /* warm up caches before timing */
+  period(voices, nframes);
+
+  start = now_ns();
+  do
+    {
+      period(voices, nframes);
+      runs++;
+      elapsed = now_ns() - start;
+    }
+  while( elapsed < RUN_NS );
+
+  return elapsed / runs / 1000.0;
+} /* measure */
+
+int
+main(int argc, char *argv[])
+{
+  int voice_counts[] = {8, 32, 48};
+  int periods[] = {64, 128, 256, 512, 1024};
+  int kernels[] = {MIXER_SCALAR, MIXER_SSE2, MIXER_AVX2};
+  int v, p, k, i, bank;
+  double base, t;
+
+  for( i = 0; i < NUM_CHANNELS; i++ )
+    outs[i] = malloc(MAX_FRAMES * sizeof(float));
+
+  srand(1);
+  for( bank = 0; bank < NUM_SAMPLES; bank++ )
+    {
+      for( i = 0; i < MAX_FRAMES; i++ )
+	voice[bank][i] = (float)rand() / RAND_MAX - 0.5f;
+      playback_mix[bank][bank % NUM_CHANNELS] = 1;
+      playback_mix[bank][(bank + 3) % NUM_CHANNELS] = 1;
+      playback_mask[bank] = (1u << (bank % NUM_CHANNELS)) |
+	(1u << ((bank + 3) % NUM_CHANNELS));
+    }
+
+  printf("voices,frames,kernel,us_per_period,speedup\n");
+  for( v = 0; v < 3; v++ )
+    for( p = 0; p < 5; p++ )
+      {
+	base = measure(period_matrix, voice_counts[v], periods[p]);
+	printf("%d,%d,matrix,%.3f,1.00\n", voice_counts[v], periods[p], base);
+	for( k = 0; k < 3; k++ )
+	  {
+	    if( mixer_use(kernels[k]) < 0 )
+	      continue;
+	    t = measure(period_block, voice_counts[v], periods[p]);
+	    printf("%d,%d,%s,%.3f,%.2f\n", voice_counts[v], periods[p],
+		   mixer_name(), t, base / t);
+	  }
+      }
+
+  return 0;
+} /* main */
@@ -0,0 +1,181 @@
+/* queuebench.c
+This file is a part of 'candor'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+times the rtqueue calls process() and the disk threads make,
+a frame at a time and in blocks, on a queue with memory of
+its own and on one borrowed from a chunk pool.  the last
+runs have a producer and a consumer thread passing blocks
+through the queue like process() and a streaming worker do.
+prints one CSV line per measurement.
+
+Copyright 2014 murray foster */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rtqueue.h"
+
+#define QUEUE_FRAMES 65536
+#define CHUNK_FRAMES 16384
+#define MAX_BLOCK 4096
+#define RUN_NS 200000000.0 /* time spent on every measurement */
+
+static float block_in[MAX_BLOCK];
+static float block_out[MAX_BLOCK];
+
+static volatile int threads_run;
+static volatile long threads_frames;
+
+static double
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+} /* now_ns */
+
+static void
+report(char *variant, char *mode, int block, double frames, double ns)
+{
+  printf("queue,%s,%s,%d,%.0f,%.3f\n", variant, mode, block,
+	 frames / ns * 1e9, ns / frames);
+} /* report */
+
+static void
+bench_single(rtqueue_t *rtq, char *variant)
+{
+  /* fill the queue and empty it again, one frame per call */
+  double start, elapsed;
+  double frames = 0;
+  float data;
+  int i;
+
+  start = now_ns();
+  do
+    {
+      for( i = 0; i < QUEUE_FRAMES; i++ )
+	rtqueue_tryenq(rtq, (float) i);
+      for( i = 0; i < QUEUE_FRAMES; i++ )
+	rtqueue_trydeq(rtq, &data);
+      frames += QUEUE_FRAMES;
+      elapsed = now_ns() - start;
+    }
+  while( elapsed < RUN_NS );
+
+  report(variant, "single", 1, frames, elapsed);
+} /* bench_single */
+
+static void
+bench_bulk(rtqueue_t *rtq, char *variant, int block)
+{
+  /* the same in blocks of 'block' frames, which is how
+     process() and the disk threads use the queues */
+  double start, elapsed;
+  double frames = 0;
+  int i;
+
+  start = now_ns();
+  do
+    {
+      for( i = 0; i < QUEUE_FRAMES; i += block )
+	rtqueue_enq_n(rtq, block_in, block);
+      for( i = 0; i < QUEUE_FRAMES; i += block )
+	rtqueue_deq_n(rtq, block_out, block);
+      frames += QUEUE_FRAMES;
+      elapsed = now_ns() - start;
+    }
+  while( elapsed < RUN_NS );
+
+  report(variant, "bulk", block, frames, elapsed);
+} /* bench_bulk */
+
+static void *
+producer(void *arg)
+{
+  /* keeps the queue topped up, like a streaming worker */
+  rtqueue_t *rtq = arg;
+
+  while( threads_run )
+    if( rtqueue_enq_n(rtq, block_in, MAX_BLOCK) == 0 )
+      rtqueue_wait_space(rtq, MAX_BLOCK);
+
+  return 0;
+} /* producer */
+
+static void
+bench_threads(rtqueue_t *rtq, char *variant, int block)
+{
+  /* take 'block' frames at a time out of a queue another
+     thread keeps filling, as fast as it can fill it */
+  pthread_t thread;
+  double start, elapsed;
+  double frames = 0;
+
+  threads_run = 1;
+  pthread_create(&thread, NULL, producer, rtq);
+
+  start = now_ns();
+  do
+    {
+      frames += rtqueue_deq_n(rtq, block_out, block);
+      elapsed = now_ns() - start;
+    }
+  while( elapsed < RUN_NS );
+
+  threads_run = 0;
+  rtqueue_drain(rtq);
+  rtqueue_wake(rtq);
+  pthread_join(thread, NULL);
+  rtqueue_drain(rtq);
+
+  report(variant, "threads", block, frames, elapsed);
+} /* bench_threads */
+
+int
+main(int argc, char *argv[])
+{
+  int blocks[] = {64, 256, 1024, 4096};
+  rtqueue_pool_t *pool;
+  rtqueue_t *queues[2];
+  char *variants[] = {"own", "pooled"};
+  int q, b, i;
+
+  for( i = 0; i < MAX_BLOCK; i++ )
+    block_in[i] = (float) i / MAX_BLOCK;
+
+  queues[0] = rtqueue_init(QUEUE_FRAMES);
+  pool = rtqueue_pool_init(CHUNK_FRAMES, QUEUE_FRAMES * sizeof(float));
+  queues[1] = rtqueue_init_pooled(pool);
+  if( (queues[0] == NULL) || (queues[1] == NULL) ||
+      rtqueue_attach(queues[1], QUEUE_FRAMES) )
+    {
+      fprintf(stderr, "queuebench: can't set up the queues\n");
+      return 1;
+    }
+
+  printf("bench,variant,mode,block,frames_per_sec,ns_per_frame\n");
+  for( q = 0; q < 2; q++ )
+    {
+      bench_single(queues[q], variants[q]);
+      for( b = 0; b < 4; b++ )
+	bench_bulk(queues[q], variants[q], blocks[b]);
+      for( b = 0; b < 4; b++ )
+	bench_threads(queues[q], variants[q], blocks[b]);
+    }
+
+  return 0;
+} /* main */
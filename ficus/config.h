@@ -19,25 +19,127 @@ mrafoster at gmail dawtcom */
 #define config_h__
 
 /* COMPILE-TIME OPTIONS */
-#define NUM_SAMPLES 48 /* number of sound files to possibly store */
-
-#define NUM_CHANNELS 8  /* number of possible in/out channels */
-
-#define IN_FRAMES 999999 /* size of audio input buffer in JACK FRAMES,
-			   PER CHANNEL. change this size based 
-			   on available system memory and intended
-			   application. under-allocating frames 
-			   (memory) will seg-fault your JACK client
-			   when attempting to capture audio for
-			   too long. Overallication will zombify your
-			   JACK client if you queue too much data. */
-
-#define OUT_FRAMES 999999 /* same as above EXCEPT for output and
-			    this output buffer size is set
-			    PER SOUND FILES ((NUM_SAMPLES). Each 
-			    soundfile in this system possesses its own
-			    buffer.  Under-allocating frames
-			    (memory) will seg-fault your JACK
-			    client.  Overallication will zombify your
-			   JACK client if you queue too much data. */
+#define NUM_SAMPLES 48 /* number of sound files to possibly store,
+			 when ficus_setup() is passed 0 banks */
+
+#define NUM_CHANNELS 8  /* number of possible in/out channels when
+			  ficus_setup() is passed 0 channels, 32
+			  at most */
+
+#define IN_FRAMES 131072 /* size of audio input queue in JACK FRAMES,
+			   PER CHANNEL. the queues borrow this
+			   memory from QUEUE_POOL only while a
+			   capture is running. input the disk
+			   can't keep up with is dropped and
+			   reported as EPIPE. */
+
+#define OUT_FRAMES 65536 /* same as above EXCEPT for output. each
+			   streaming soundfile borrows its own
+			   queue of this size while it plays and
+			   gives it back when it stops. */
+
+#define QUEUE_CHUNK 16384 /* queue memory is handed out in chunks
+			    of this many frames. */
+
+#define QUEUE_POOL 33554432 /* bytes of queue memory shared by all
+			      banks and input channels, can be
+			      changed with ficus_queue_pool()
+			      before ficus_setup(). once it's spent
+			      further banks play silently and
+			      captures fail with ENOMEM. */
+
+#define STREAM_FRAMES 16384 /* number of frames each playing sound
+			       file reads from disk at once. every
+			       bank keeps a staging buffer this size
+			       (times the file's channel count) and
+			       only goes back to the disk once the
+			       playback position leaves it. */
+
+#define PREFETCH_FRAMES 262144 /* frames ahead of every streaming
+				 bank the kernel is asked to read
+				 into the page cache in the
+				 background, so the reads of all
+				 banks are queued at once and the
+				 disk can merge them. 0 turns it
+				 off, ficus_prefetch() changes it */
+
+#define PRELOAD_FRAMES 480000 /* sound files up to this many frames
+				long are decoded into memory when
+				they are loaded and played straight
+				from memory. see ficus_preload() */
+
+#define PRELOAD_BUDGET 268435456 /* bytes of memory all preloaded
+				    sound files may use together,
+				    can be changed at runtime with
+				    ficus_preload_budget() */
+
+#define HEAD_MS 250 /* milliseconds at the start of every sound
+		       file that's streamed from disk kept in
+		       memory. a trigger plays them straight
+		       away while the streaming pool reads on
+		       from there, so it never waits for the
+		       disk. ficus_head_cache() changes it */
+
+#define STREAM_WORKERS 0 /* number of threads that read sound
+			    files from disk for playback, shared
+			    by every bank. 0 starts one per cpu
+			    core.  can be changed before
+			    ficus_setup() with
+			    ficus_stream_workers() */
+
+#define RESAMPLE_QUALITY FICUS_RESAMPLE_CUBIC /* how banks fill in between
+						 frames when they play at
+						 speeds other than 1. 
+						 FICUS_RESAMPLE_LINEAR is
+						 the cheapest, 
+						 FICUS_RESAMPLE_SINC the
+						 cleanest. can be changed
+						 per bank at runtime with
+						 ficus_playback_quality() */
+
+#define RETRIGGER_FADE 128 /* frames a bank that's playing fades out
+			      over when it's retriggered, so starting
+			      it over doesn't click. 0 cuts it off
+			      straight away */
+
+#define VOICE_POOL 64 /* voices that preloaded banks with a
+			polyphony above 1 share, for playing
+			on after they're retriggered. when
+			they're all taken the oldest is cut.
+			ficus_voice_pool() changes it before
+			ficus_setup() */
+
+#define LOOP_FADE 0 /* frames the end of a loop crossfades into
+		       its start over, at equal power, so loop
+		       points that don't meet at a zero crossing
+		       don't click. ficus_loop_fade() changes it
+		       per bank */
+
+#define LOOP_FADE_MAX 8192 /* longest crossfade ficus_loop_fade()
+			      takes. streamed banks keep this many
+			      frames apart for it */
+
+#define CAPTURE_BLOCK 4096 /* most frames the capture thread takes
+			      from every input channel and writes
+			      to disk at once.  bigger blocks mean
+			      fewer, larger writes, the capture
+			      thread never waits longer than a
+			      few periods for one to fill up */
+
+#define EVENT_QUEUE 1024 /* events ficus_schedule() and the other
+			   ficus_* mutators can have waiting for
+			   process() at once. further scheduled
+			   events are refused, mutators wait until
+			   process() catches up. */
+
+#define RENDER_RATE 48000 /* sample rate ficus_render_setup() renders
+			    at offline when it's passed 0 */
+
+#define RENDER_PERIOD 256 /* frames ficus_render() has process()
+			    render at once when ficus_render_setup()
+			    is passed 0.  events land on their
+			    exact frame at any period size,
+			    streamed banks start on the period
+			    after they're triggered */
+
 #endif
@@ -0,0 +1,123 @@
+/* evqueue.c
+This file is a part of 'ficus'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+'evqueue' is a bounded multi-producer/single-consumer ring of 
+timestamped events for the JACK process() callback.
+
+every slot carries a sequence number.  a producer claims the 
+tail with a compare-and-swap, fills the slot in, then publishes
+it by bumping its sequence.  the consumer only takes slots whose
+sequence says they're published, so a producer that's slow to
+finish holds up the events behind it but never hands over a
+half-written one.
+
+Copyright 2014 murray foster */
+
+#include <stdlib.h>
+#include <string.h>
+#include "evqueue.h"
+
+evqueue_t *
+evqueue_init(int size)
+{
+  evqueue_t *evq;
+  unsigned int slots = 1;
+  unsigned int i;
+
+  while( slots < (unsigned int) size )
+    slots <<= 1;
+
+  if( posix_memalign((void **) &evq, EVQUEUE_CACHELINE, sizeof(evqueue_t)) )
+    return NULL;
+  memset(evq, 0, sizeof(evqueue_t));
+
+  evq->slots = calloc(slots, sizeof(evqueue_slot_t));
+  if( evq->slots == NULL )
+    {
+      free(evq);
+      return NULL;
+    }
+
+  for( i = 0; i < slots; i++ )
+    atomic_init(&evq->slots[i].sequence, i);
+  atomic_init(&evq->head, 0);
+  atomic_init(&evq->tail, 0);
+  evq->mask = slots - 1;
+
+  return evq;
+} /* evqueue_init */
+
+void
+evqueue_free(evqueue_t *evq)
+{
+  free(evq->slots);
+  free(evq);
+} /* evqueue_free */
+
+int
+evqueue_push(evqueue_t *evq, const event_t *event)
+{
+  evqueue_slot_t *slot;
+  unsigned int tail, sequence;
+  int lap;
+
+  tail = atomic_load_explicit(&evq->tail, memory_order_relaxed);
+  while( 1 )
+    {
+      slot = &evq->slots[tail & evq->mask];
+      sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+      lap = (int) (sequence - tail);
+
+      if( lap == 0 )
+	{
+	  /* the slot is free, try to claim it */
+	  if( atomic_compare_exchange_weak_explicit(&evq->tail, &tail, tail + 1,
+						    memory_order_relaxed,
+						    memory_order_relaxed) )
+	    break;
+	}
+      else if( lap < 0 )
+	/* the consumer hasn't got to it yet, we're full */
+	return 1;
+      else
+	/* somebody else claimed it, catch up */
+	tail = atomic_load_explicit(&evq->tail, memory_order_relaxed);
+    }
+
+  slot->event = *event;
+  atomic_store_explicit(&slot->sequence, tail + 1, memory_order_release);
+
+  return 0;
+} /* evqueue_push */
+
+int
+evqueue_pop(evqueue_t *evq, event_t *event)
+{
+  evqueue_slot_t *slot;
+  unsigned int head;
+
+  head = atomic_load_explicit(&evq->head, memory_order_relaxed);
+  slot = &evq->slots[head & evq->mask];
+
+  if( atomic_load_explicit(&slot->sequence, memory_order_acquire) != head + 1 )
+    return 0;
+
+  *event = slot->event;
+
+  /* hand the slot back to the producers for the next lap */
+  atomic_store_explicit(&slot->sequence, head + evq->mask + 1, memory_order_release);
+  atomic_store_explicit(&evq->head, head + 1, memory_order_relaxed);
+
+  return 1;
+} /* evqueue_pop */
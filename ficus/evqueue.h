@@ -0,0 +1,65 @@
+/* evqueue.h
+This file is a part of 'ficus'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+'evqueue' is a bounded multi-producer/single-consumer ring of 
+timestamped events.  any number of control threads push events,
+the JACK process() callback pops them.
+
+evqueue_push() and evqueue_pop() never block or allocate, a
+full queue just refuses the event.
+
+Copyright 2014 murray foster */
+
+#ifndef evqueue_h__
+#define evqueue_h__
+
+#include <stdatomic.h>
+
+#define EVQUEUE_CACHELINE 64
+
+typedef struct event
+{
+  /* JACK frame time the event is due at */
+  unsigned int frame;
+  int type;
+  int bank;
+  int arg;
+  float value;
+} event_t;
+
+typedef struct evqueue_slot
+{
+  /* which lap of the ring the slot is ready for */
+  atomic_uint sequence;
+  event_t event;
+} evqueue_slot_t;
+
+typedef struct evqueue
+{
+  _Alignas(EVQUEUE_CACHELINE) atomic_uint head;
+  _Alignas(EVQUEUE_CACHELINE) atomic_uint tail;
+  _Alignas(EVQUEUE_CACHELINE) unsigned int mask;
+  evqueue_slot_t *slots;
+} evqueue_t;
+
+/* 'size' is rounded up to a power of two */
+evqueue_t *evqueue_init(int size);
+void evqueue_free(evqueue_t *evq);
+
+/* any thread. returns 1 if the queue is full */
+int evqueue_push(evqueue_t *evq, const event_t *event);
+/* consumer only. returns 0 if the queue is empty */
+int evqueue_pop(evqueue_t *evq, event_t *event);
+
+#endif
@@ -24,6 +24,9 @@ mrafoster at gmail dawt com */
 
 #include <math.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 
 #include <jack/jack.h>
 
@@ -31,34 +34,140 @@ mrafoster at gmail dawt com */
 
 #include "libficus.h"
 #include "rtqueue.h"
+#include "mixer.h"
+#include "resampler.h"
+#include "evqueue.h"
+#include "wavmap.h"
 
 /* COMPILE-TIME DEFAULTS */
-#define NUM_SAMPLES 48 /* number of sample banks */
-#define NUM_CHANNELS 8  /* number of in/out channels */
-#define IN_FRAMES 300000 /* size of input buffer in FRAMES,
-			   change this size based on available
-			   system memory */
-#define OUT_FRAMES 300000 /* same as above but for output */
+#define NUM_SAMPLES 48 /* sample banks when ficus_setup() is passed 0 */
+#define NUM_CHANNELS 8  /* in/out channels when ficus_setup() is passed 0 */
+#define IN_FRAMES 131072 /* frames queued per input channel while
+			   capturing, borrowed from the queue pool */
+#define OUT_FRAMES 65536 /* frames queued per streaming bank */
+#define QUEUE_CHUNK 16384 /* frames in each chunk of the queue pool */
+#define QUEUE_POOL 33554432 /* bytes of queue memory all banks share */
+#define STREAM_FRAMES 16384 /* frames read from disk at once */
+#define PREFETCH_FRAMES 262144 /* frames ahead of a streaming bank the disk reads in the background */
+#define PRELOAD_FRAMES 480000 /* longest sound file kept in memory */
+#define PRELOAD_BUDGET 268435456 /* bytes all preloaded files may use */
+#define HEAD_MS 250 /* milliseconds of a streamed file kept in memory for triggers */
+#define QUEUE_REFILL 4096 /* frames a streaming worker queues for a bank at once */
+#define VOICE_BLOCK 256 /* frames process() renders per voice at once */
+#define STREAM_WORKERS 0 /* disk streaming threads, 0 is one per core */
+#define RETRIGGER_FADE 128 /* frames a retriggered voice fades out over */
+#define VOICE_POOL 64 /* voices all polyphonic banks share */
+#define LOOP_FADE 0 /* frames the end of a loop crossfades into its start over */
+#define LOOP_FADE_MAX 8192 /* longest loop crossfade ficus_loop_fade() takes */
+#define CAPTURE_BLOCK 4096 /* frames the capture thread writes at once */
+#define EVENT_QUEUE 1024 /* events and commands that can wait for process() at once */
+#define TRANSPORT_LEAD 2 /* periods ahead the transport's first step lands */
+#define TIMEBASE_BEATS_PER_BAR 4 /* bar length we publish as timebase master */
+#define TIMEBASE_TICKS 1920 /* ticks per beat we publish as timebase master */
+#define RENDER_RATE 48000 /* sample rate of offline rendering when ficus_render_setup() is passed 0 */
+#define RENDER_PERIOD 256 /* frames ficus_render() runs process() for at once */
+#define RESAMPLE_QUALITY FICUS_RESAMPLE_CUBIC /* interpolation used when
+						  playback speed isn't 1 */
 
 #include "config.h"
 
+/* routing is a 32 bit mask per bank */
+#define MAX_CHANNELS 32
+
+#if NUM_CHANNELS > MAX_CHANNELS
+#error "routing is a 32 bit mask, NUM_CHANNELS can't exceed 32"
+#endif
+
+/* per-bank state process() reads every period. it's kept 
+   apart from everything else so a playing voice costs 
+   process() two cache lines */
 typedef struct _thread_info
-{	
-  pthread_t thread_id ;
-  SNDFILE *sndfile ;
-  jack_nframes_t pos ;
-  unsigned int channel_out ;
-  volatile int read_done ;
-  volatile int play_done;
-  volatile int bank_number;
-  volatile int user_interrupt;
-  volatile int kill;
-  volatile int reverse;
-  volatile float speedmult;
-  volatile float rampup;
-  volatile float rampdown;
+{
+  _Alignas(64) atomic_int generation ;
+  atomic_int generation_ready ;
+  unsigned int generation_start ;
+  volatile int playing ;
+  atomic_int triggers_posted ;
+  volatile int streaming ;
+  volatile int stream_eof ;
+  volatile int reverse ;
+  volatile int loop ;
+  volatile sf_count_t loop_start ;
+  volatile sf_count_t loop_end ;
+  volatile int loop_fade ;
+  volatile unsigned int playback_mask ;
+  int quality ;
+  volatile float speedmult ;
+  volatile float rampup ;
+  volatile float rampdown ;
+  float *ram ;
+  sf_count_t ram_frames ;
+  sf_count_t ram_pos ;
+  /* only process() touches these */
+  unsigned int underruns ;
+  int polyphony ;
+  int stops ;
+  int voice_gen ;
+  int fade_left ;
+  char waiting ;
+  char listed ;
+  char queue_wait ;
 } thread_info_t ;
 
+_Static_assert (sizeof (thread_info_t) <= 128,
+		"thread_info_t outgrew the two cache lines process() reads") ;
+
+/* the head of a streamed bank's soundfile, kept in memory so
+   triggers don't wait for the disk. process() only looks at it
+   when a trigger comes in and while the head plays, so it's
+   kept out of thread_info_t */
+typedef struct _head_info
+{
+  float *ram ;
+  sf_count_t frames ;
+  volatile sf_count_t stream_from ;
+  /* only process() touches this */
+  sf_count_t pos ;
+} head_info_t ;
+
+/* a soundfile load_bank() has opened and decoded, for process()
+   to swap in for the one the bank plays. once it's swapped this
+   holds the bank's old memory, for load_bank() to free */
+typedef struct _bank_load
+{
+  SF_INFO sfinfo ;
+  float *ram ;
+  sf_count_t ram_frames ;
+  float *head ;
+  sf_count_t head_frames ;
+  /* the bank's generation when it was swapped */
+  int generation ;
+  /* the last swap process() carried out */
+  atomic_int done ;
+} bank_load_t ;
+
+/* per-bank state of the streaming pool, process() never
+   looks at it */
+typedef struct _stream_info
+{
+  SNDFILE *sndfile ;
+  wavmap_t *wavmap ;
+  int hint_fd ;
+  /* size of the file behind hint_fd */
+  off_t hint_size ;
+  sf_count_t prefetch_pos ;
+  sf_count_t pos ;
+  float *stream_buf ;
+  sf_count_t stream_start ;
+  sf_count_t stream_count ;
+  float *fade_buf ;
+  sf_count_t fade_first ;
+  int fade_frames ;
+  int channels ;
+  int generation_seen ;
+  atomic_int claimed ;
+} stream_info_t ;
+
 typedef struct _thread_info_in
 {
   SNDFILE *sndfile;
@@ -67,18 +176,24 @@ typedef struct _thread_info_in
   unsigned int channels;
   int bitdepth;
   char *path;
+  char *tmp_path;
+  float *ram;
+  sf_count_t ram_size;
+  int keep_ram;
   volatile int can_capture;
   volatile int status;
   volatile int bank_number;
   volatile int total_captured;
   volatile int can_process;
   volatile int kill;
+  /* what overruns was when this capture armed */
+  long overruns_armed;
 }thread_info_in_t ;
 
 pthread_t capture_thread_id;
 int capture_thread_isrunning = 0; 
-pthread_mutex_t capture_thread_wait_mutex;
-pthread_cond_t capture_thread_wait_cond;
+pthread_mutex_t capture_thread_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t capture_thread_wait_cond = PTHREAD_COND_INITIALIZER;
 
 const size_t sample_size = sizeof (jack_default_audio_sample_t) ;
 
@@ -88,86 +203,1204 @@ static jack_port_t **input_port ;
 static jack_default_audio_sample_t ** outs ;
 static jack_default_audio_sample_t ** ins ;
 
-SNDFILE *sndfile[NUM_SAMPLES] ;
-SNDFILE *sndfile_in[NUM_SAMPLES] ;
+/* bank and channel counts, fixed by ficus_setup(). every
+   per-bank and per-channel array is sized by these */
+int num_banks = NUM_SAMPLES;
+int num_channels = NUM_CHANNELS;
 
-SF_INFO sndfileinfo[NUM_SAMPLES] ;
-SF_INFO sndfileinfo_in[NUM_SAMPLES];
+SNDFILE **sndfile ;
+SNDFILE **sndfile_in ;
 
-/* allows disk_thread() to signal process() that there's data to read */
-int samples_can_process[NUM_SAMPLES] = {0};
-int samples_wait_process[NUM_SAMPLES] = {0};
-pthread_mutex_t samples_wait_process_mutex[NUM_SAMPLES];
-pthread_cond_t samples_wait_process_cond[NUM_SAMPLES];
-int samples_finished_playing[NUM_SAMPLES] = {0};
-pthread_mutex_t samples_finished_playing_mutex[NUM_SAMPLES];
-pthread_cond_t samples_finished_playing_cond[NUM_SAMPLES];
+SF_INFO *sndfileinfo ;
+SF_INFO *sndfileinfo_in ;
 
-/* active file record for in/out of every sample,
-   [0] is playback, [1] is capture */
-int active_file_record[2][NUM_SAMPLES] = {{0}};
+/* banks that are capturing. playback has info[].playing */
+int *capture_record ;
 
 jack_client_t *client=NULL;
-thread_info_t info[NUM_SAMPLES] ;
-thread_info_in_t info_in[NUM_SAMPLES] ;
+thread_info_t *info ;
+stream_info_t *stream_info ;
+head_info_t *head_info ;
+bank_load_t *bank_load ;
+/* held for as long as a bank is being loaded. control threads
+   and the capture thread, with a finished capture, load banks */
+pthread_mutex_t *load_mutex ;
+thread_info_in_t *info_in ;
 
 int jack_sr;
 
-int capture_mix[NUM_SAMPLES][NUM_CHANNELS] = {{0}};
-int playback_mix[NUM_SAMPLES][NUM_CHANNELS] = {{0}};
-int loop_state[NUM_SAMPLES] = {0};
+/* offline rendering. instead of JACK calling process() it's
+   ficus_render() that does, a period at a time and as fast as
+   the cpu allows. render_time stands in for JACK's frame time
+   and render_mutex is held for as long as process() runs */
+int render_offline = 0;
+jack_nframes_t render_time = 0;
+jack_nframes_t render_period = RENDER_PERIOD;
+pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+float *render_buf = NULL;
+float *render_frames = NULL;
+float *render_stream_buf = NULL;
+SNDFILE *render_out = NULL;
+SNDFILE *render_in = NULL;
+int render_in_channels = 0;
+
+/* input routing, bit n set means the bank captures channel n.
+   output routing is info[].playback_mask */
+volatile unsigned int *capture_mask ;
+
+/* for recording, input frames lost because the capture
+   queues were full. it only ever counts up, each capture
+   compares it with what it was when it armed */
+volatile long overruns = 0;
+
+/* engine statistics. process() is the only one writing them,
+   except for xruns which JACK counts for us, so they're plain 
+   relaxed atomics anyone may read at any time. asking for a
+   reset sets stats_reset, process() starts min/avg/max over */
+atomic_ulong stats_periods;
+atomic_ulong stats_xruns;
+atomic_ulong stats_underruns;
+atomic_ullong stats_ns_sum;
+atomic_ulong stats_ns_count;
+atomic_ullong stats_ns_min;
+atomic_ullong stats_ns_max;
+atomic_int stats_reset = 1;
+
+/* trigger latency measurement. ficus_latency_ingress() stamps
+   the moment a bank was asked to play, every hop its trigger
+   takes on the way out gets stamped after it by whichever
+   thread it passes through, in turn, and once its first
+   sound leaves process() they all go into the histograms of
+   the path it came in on. a probe only ever follows one
+   trigger per bank, a newer one takes it over */
+#define PROBE_IDLE 0
+#define PROBE_INGRESS 1
+#define PROBE_DISPATCHED 2
+#define PROBE_APPLIED 3
+typedef struct _latency_probe
+{
+  atomic_int state ;
+  int path ;
+  unsigned long long ingress ;
+  unsigned long long hop[FICUS_LATENCY_HOPS] ;
+} latency_probe_t ;
+
+volatile int latency_enabled = 0;
+latency_probe_t *latency_probe ;
+atomic_ulong latency_hist[FICUS_LATENCY_PATHS][FICUS_LATENCY_HOPS][FICUS_LATENCY_BUCKETS];
+/* CLOCK_MONOTONIC when the period process() renders began */
+unsigned long long period_ns;
+
+/* lock-free playback/capture data queues. they only hold
+   memory from the pool while a bank streams or a capture runs */
+rtqueue_pool_t *queue_pool = NULL;
+long queue_pool_bytes = QUEUE_POOL;
+rtqueue_t **fifo_out;
+rtqueue_t **fifo_in;
+
+/* RAM-resident sample cache, banks that fit are decoded once
+   by ficus_loadfile() and played by process() from memory */
+int *preload_mode;
+long preload_budget = PRELOAD_BUDGET;
+long preload_used = 0;
+/* captures and loads charge the budget from different threads,
+   checking and charging it happen under this */
+pthread_mutex_t preload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* streamed banks keep the first head_ms milliseconds of their
+   soundfile in head_info[].ram. a trigger plays those from
+   memory straight away while the pool queues the rest, from
+   frame head_info[].stream_from on */
+int head_ms = HEAD_MS;
+
+/* frames ahead of a streaming bank the kernel is asked to
+   read in the background, see stream_prefetch() */
+long prefetch_frames = PREFETCH_FRAMES;
+
+/* banks process() is currently playing. other threads only flag
+   banks in voice_pending, the list itself belongs to process() */
+int voice_words;
+atomic_ullong *voice_pending;
+int *active_voices;
+int active_count = 0;
+static float voice_buf[VOICE_BLOCK];
+
+/* varispeed state of every voice, plus room for the source
+   frames the longest block can read at top speed */
+resampler_t *voice_rs;
+static float voice_src[RESAMPLER_SRC_FRAMES(VOICE_BLOCK)];
+
+/* every ficus_playback() starts a new generation of its bank.
+   info[].voice_gen is the one process() plays, while it's
+   waiting it waits for the streaming pool to queue the start
+   of it. the voice it replaced fades out from voice_fade */
+float *voice_fade;
+#define VOICE_FADE(bank) (voice_fade + (bank) * (RETRIGGER_FADE + 1))
+static float fade_gain[RETRIGGER_FADE + 1];
+
+/* voices a preloaded bank with a polyphony above 1 let go of
+   when it's retriggered. they play on from the bank's memory,
+   with the speed and direction they had, until they reach the
+   end, the bank is stopped or a newer voice needs the room.
+   a bank keeps polyphony - 1 of them at most, the oldest
+   fades out first, once the pool is full the oldest of all
+   is cut. only process() touches them */
+typedef struct _voice
+{
+  int bank ;
+  int reverse ;
+  int stops ;
+  int fade_left ;
+  unsigned int age ;
+  double speed ;
+  float *ram ;
+  sf_count_t pos ;
+  resampler_t rs ;
+} voice_t ;
+
+int voice_pool_size = VOICE_POOL;
+voice_t *voice_pool;
+int *pool_active;
+int pool_count = 0;
+unsigned int voice_age = 0;
+
+/* events scheduled with ficus_schedule(). process() moves them
+   from the queue into event_pending, sorted by when they're due,
+   and applies each at its frame within the period */
+evqueue_t *events;
+static event_t event_pending[EVENT_QUEUE];
+int event_count = 0;
+
+/* load_bank() handing process() a new soundfile. it's never
+   scheduled from outside, so it isn't one of the FICUS_EVENT_*,
+   arg is the swap's sequence number */
+#define EVENT_LOAD 100
+
+/* the sequencer transport. process() counts it off in frames,
+   the fractional frame position of the next step keeps adding
+   up so the steps never drift from the audio clock.  it posts
+   transport_sem whenever steps went by, transport_position packs
+   the number of steps so far with the frame of the next one */
+#define TRANSPORT_STOPPED 0
+#define TRANSPORT_STARTING 1
+#define TRANSPORT_ROLLING 2
+atomic_int transport_state = TRANSPORT_STOPPED;
+volatile double transport_bpm = 120.0;
+jack_nframes_t transport_start;
+jack_nframes_t transport_origin;
+double transport_next;
+unsigned int transport_count;
+atomic_ullong transport_position;
+unsigned int transport_seen;
+sem_t transport_sem;
+
+/* whether steps follow our own clock or JACK's transport, a
+   step is one beat of it.  as timebase master we also tell 
+   every other JACK client where the beats are */
+volatile int transport_sync = FICUS_SYNC_INTERNAL;
+double timebase_beats = 0;
+jack_nframes_t timebase_frame = 0;
+int timebase_valid = 0;
+
+/* counts JACK periods, lets us know when process() is done with memory */
+volatile unsigned long process_cycles = 0;
+/* set once ficus_clean() has stopped process() for good */
+volatile int process_stopped = 0;
+
+/* streaming worker pool, a few threads keep the playback
+   queues of every bank that plays from disk topped up */
+int stream_workers = STREAM_WORKERS;
+pthread_t *stream_worker_id = NULL;
+float *stream_worker_buf = NULL;
+volatile int stream_workers_run = 0;
+pthread_mutex_t stream_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stream_wait_cond = PTHREAD_COND_INITIALIZER;
+/* bumped whenever there's new work for the pool */
+atomic_uint stream_work;
+/* process() saw a streamed voice running low this period */
+int stream_hungry = 0;
+
+jack_nframes_t
+frame_time ()
+{
+  /* roughly the frame process() has got to, JACK's frame
+     time or how far offline rendering is */
+  if( render_offline )
+    return render_time;
+
+  return jack_frame_time(client);
+} /* frame_time */
+
+jack_nframes_t
+period_size ()
+{
+  if( render_offline )
+    return render_period;
+
+  return jack_get_buffer_size(client);
+} /* period_size */
+
+unsigned long long
+latency_clock ()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} /* latency_clock */
+
+unsigned long long
+latency_frame_ns (jack_nframes_t frame)
+{
+  /* when frame 'frame' of the current period leaves process() */
+  return period_ns + (unsigned long long) frame * 1000000000ULL / jack_sr;
+} /* latency_frame_ns */
+
+void
+latency_finish (latency_probe_t *probe)
+{
+  /* the trigger made it out, bin how long each hop took from
+     ingress. bucket 0 is under a microsecond, bucket b holds
+     [2^(b-1), 2^b) microseconds */
+  unsigned long long us;
+  int hop, bucket;
+
+  for( hop = 0; hop < FICUS_LATENCY_HOPS; hop++ )
+    {
+      /* preloaded banks never go near the disk */
+      if( probe->hop[hop] == 0 )
+	continue;
+
+      us = probe->hop[hop] > probe->ingress ?
+	(probe->hop[hop] - probe->ingress) / 1000 : 0;
+      bucket = us ? 64 - __builtin_clzll(us) : 0;
+      if( bucket >= FICUS_LATENCY_BUCKETS )
+	bucket = FICUS_LATENCY_BUCKETS - 1;
+      atomic_fetch_add_explicit(&latency_hist[probe->path][hop][bucket], 1,
+				memory_order_relaxed);
+    }
+
+  atomic_store_explicit(&probe->state, PROBE_IDLE, memory_order_release);
+} /* latency_finish */
+
+float
+ramp_factor (thread_info_t *info, int reverse, sf_count_t frames, sf_count_t pos)
+{
+  /* amplitude of the attack and decay envelopes at frame 'pos' 
+     of a soundfile 'frames' long, played in 'reverse' or not */
+  float factor = 1.0;
+  float ramplength = 0;
+  float rampstart = 0;
+
+  /* if this sample has a ramp UP envelope.. */
+  if( info->rampup )
+    {
+      /* figure out the length of the ramp */
+      ramplength = frames * info->rampup;
+      rampstart = frames - ramplength;
+      /* if the ramp is still in progress, scale the frame */
+      if( reverse == 0 )
+	{
+	  if( pos < ramplength )
+	    factor *= pos / ramplength;
+	}
+      else
+	if( pos > rampstart )
+	  factor *= (frames - pos) / ramplength;
+    }
+
+  /* if this sample has a ramp DOWN envelope.. */
+  if( info->rampdown )
+    {
+      /* figure out length and start of this envelope */
+      ramplength = frames * info->rampdown;
+      rampstart = frames - ramplength;
+      /* if this ramp has started, scale the frame */
+      if( reverse == 0 )
+	{
+	  if( pos > rampstart )
+	    factor *= (frames - pos) / ramplength;
+	}
+      else
+	if( pos < ramplength )
+	  factor *= pos / ramplength;
+    }
+
+  return factor;
+} /* ramp_factor */
+
+int
+loop_bounds (thread_info_t *info, int reverse, sf_count_t frames,
+	     sf_count_t *start, sf_count_t *end)
+{
+  /* the frames [start, end) of a soundfile 'frames' long that
+     a looping bank repeats, the whole of it unless loop points
+     were set. returns how long the crossfade from the end of
+     the loop into its start is. it borrows the frames just
+     outside the loop, before its start playing forward or
+     after its end in reverse, so it can't be any longer than
+     there are of those */
+  sf_count_t fade = info->loop_fade;
+
+  *end = info->loop_end;
+  if( (*end <= 0) || (*end > frames) )
+    *end = frames;
+  *start = info->loop_start;
+  if( (*start < 0) || (*start >= *end) )
+    *start = 0;
+
+  if( !info->loop )
+    return 0;
+
+  if( fade > *end - *start )
+    fade = *end - *start;
+  if( fade > (reverse ? frames - *end : *start) )
+    fade = reverse ? frames - *end : *start;
+
+  return fade;
+} /* loop_bounds */
+
+static inline sf_count_t
+loop_next (thread_info_t *info, int reverse, sf_count_t start, sf_count_t end,
+	   sf_count_t pos)
+{
+  /* the frame played after 'pos', which is back at the other
+     end of the loop once it's been played through. a bank
+     that's already past the loop plays on to the end of the
+     soundfile first */
+  if( reverse )
+    return (info->loop && (pos == start)) ? end - 1 : pos - 1;
+
+  return (info->loop && (pos == end - 1)) ? start : pos + 1;
+} /* loop_next */
+
+static inline sf_count_t
+loop_partner (int reverse, sf_count_t start, sf_count_t end, int fade,
+	      sf_count_t pos, float *gain_out, float *gain_in)
+{
+  /* the frame that frame 'pos' crossfades with, the one that
+     would be playing if the loop had already started over, or
+     -1 if 'pos' isn't part of the crossfade. the gains keep
+     the power constant across it */
+  sf_count_t k;
+  float t;
+
+  if( reverse )
+    {
+      if( (pos < start) || (pos >= start + fade) )
+	return -1;
+      k = start + fade - 1 - pos;
+    }
+  else
+    {
+      if( (pos < end - fade) || (pos >= end) )
+	return -1;
+      k = pos - (end - fade);
+    }
+
+  t = (k + 0.5) / fade * M_PI_2;
+  *gain_out = cosf(t);
+  *gain_in = sinf(t);
 
-/* for recording */
-long overruns = 0;
+  return reverse ? end + fade - 1 - k : start - fade + k;
+} /* loop_partner */
 
-/* lock-free playback/capture data queues */
-rtqueue_t *fifo_out[NUM_SAMPLES];
-rtqueue_t *fifo_in[NUM_CHANNELS];
+int
+ram_fetch (thread_info_t *info, sf_count_t *pos, int reverse, float *buf, int nframes)
+{
+  /* copy the next nframes of a preloaded bank, from frame 'pos'
+     on, into buf in the order they're played. 'pos' is the bank's
+     own or one of its pool voices'.  this is called from process()
+     so it may never block. returns how many frames there were,
+     less than nframes once the bank has reached its end */
+  sf_count_t start, end, partner;
+  float gain_out, gain_in;
+  int i, fade;
+
+  fade = loop_bounds(info, reverse, info->ram_frames, &start, &end);
+
+  for( i = 0; i < nframes; i++ )
+    {
+      /* fell off either end of the sample */
+      if( (*pos < 0) || (*pos >= info->ram_frames) )
+	{
+	  if( info->loop && (info->ram_frames > 0) )
+	    *pos = reverse ? end - 1 : start;
+	  else
+	    return i;
+	}
 
-int fifo_out_clear_amount[NUM_SAMPLES]={0};
-int fifo_out_clear_sig[NUM_SAMPLES]={0};
-pthread_t fifo_out_clear_thread_id; 
+      buf[i] = info->ram[*pos];
 
-void *
-clear_fifo_out (int bank, int numrecords)
+      /* the end of the loop fades into its start */
+      if( fade &&
+	  ((partner = loop_partner(reverse, start, end, fade, *pos,
+				   &gain_out, &gain_in)) >= 0) )
+	buf[i] = buf[i] * gain_out + info->ram[partner] * gain_in;
+
+      buf[i] *= ramp_factor(info, reverse, info->ram_frames, *pos);
+
+      *pos = loop_next(info, reverse, start, end, *pos);
+    }
+
+  return nframes;
+} /* ram_fetch */
+
+void
+voice_activate (int bank)
 {
-  while(1) 
+  /* let process() know this bank has something to play, 
+     safe to call from any thread */
+  atomic_fetch_or(&voice_pending[bank / 64], 1ULL << (bank % 64));
+} /* voice_activate */
+
+void
+voice_collect ()
+{
+  /* move banks flagged by voice_activate() onto process()' 
+     list of active voices */
+  unsigned long long pending;
+  int word, bank;
+
+  for( word = 0; word < voice_words; word++ )
+    {
+      if( atomic_load_explicit(&voice_pending[word], memory_order_relaxed) == 0 )
+	continue;
+
+      pending = atomic_exchange(&voice_pending[word], 0);
+      while( pending )
+	{
+	  bank = word * 64 + __builtin_ctzll(pending);
+	  pending &= pending - 1;
+	  if( !info[bank].listed )
+	    {
+	      info[bank].listed = 1;
+	      /* there's nothing playing to fade out */
+	      info[bank].waiting = 1;
+	      info[bank].fade_left = 0;
+	      active_voices[active_count++] = bank;
+	    }
+	}
+    }
+} /* voice_collect */
+
+int
+head_fetch (int bank, float *buf, int nframes)
+{
+  /* copy the next nframes of a streamed bank's head into buf.
+     returns how many frames there were, 0 once the trigger
+     has played what it could of it */
+  head_info_t *hd = &head_info[bank];
+  int i;
+
+  for( i = 0; (i < nframes) && (hd->pos < hd->stream_from); i++ )
     {
-      if(rtqueue_isempty(fifo_out[bank]))
+      buf[i] = hd->ram[hd->pos] *
+	ramp_factor(&info[bank], 0, sndfileinfo[bank].frames, hd->pos);
+      hd->pos++;
+    }
+
+  return i;
+} /* head_fetch */
+
+int
+voice_source (int bank, float *src, int need, int *eof)
+{
+  /* fetch the source frames the resampler needs next, padding
+     whatever's missing with zeros. at the end of a soundfile the
+     resampler gets to play out what's left, otherwise the disk
+     couldn't keep up and we just drop out for a bit */
+  int got;
+
+  if( info[bank].ram )
+    {
+      /* preloaded banks play straight from memory */
+      got = ram_fetch(&info[bank], &info[bank].ram_pos, info[bank].reverse, src, need);
+      *eof = 1;
+    }
+  else
+    {
+      /* the head of the soundfile plays from memory */
+      got = head_fetch(bank, src, need);
+
+      /* and the queue takes over as soon as the new
+	 generation is in it */
+      if( info[bank].queue_wait &&
+	  (atomic_load_explicit(&info[bank].generation_ready, memory_order_acquire) ==
+	   info[bank].voice_gen) )
+	{
+	  rtqueue_seek(fifo_out[bank], info[bank].generation_start);
+	  info[bank].queue_wait = 0;
+	}
+
+      /* once the end of file is flagged everything up to it
+	 is already queued */
+      *eof = !info[bank].queue_wait && info[bank].stream_eof;
+      atomic_thread_fence(memory_order_acquire);
+
+      if( !info[bank].queue_wait )
+	got += rtqueue_deq_n(fifo_out[bank], src + got, need - got);
+
+      /* the disk fell behind */
+      if( (got < need) && !*eof )
+	{
+	  info[bank].underruns++;
+	  atomic_store_explicit(&stats_underruns,
+				atomic_load_explicit(&stats_underruns, memory_order_relaxed) + 1,
+				memory_order_relaxed);
+	}
+
+      /* ask the pool for more once there's room for it */
+      if( !*eof && (rtqueue_space(fifo_out[bank]) >= QUEUE_REFILL) )
+	stream_hungry = 1;
+    }
+
+  if( got < need )
+    memset(src + got, 0, (need - got) * sample_size);
+
+  return got;
+} /* voice_source */
+
+void
+voice_fadeout (int bank, double speed)
+{
+  /* render the next RETRIGGER_FADE frames of the voice being
+     replaced, fading out, to be mixed under the new one */
+  resampler_t *rs = &voice_rs[bank];
+  float *src = voice_src + RESAMPLER_HISTORY;
+  int i, need, got, eof;
+
+  need = resampler_need(rs, RETRIGGER_FADE, speed);
+  got = voice_source(bank, src, need, &eof);
+  if( got < need )
+    resampler_end(rs, got);
+  resampler_run(rs, info[bank].quality, voice_src, need,
+		VOICE_FADE(bank), RETRIGGER_FADE, speed);
+
+  for( i = 0; i < RETRIGGER_FADE; i++ )
+    VOICE_FADE(bank)[i] *= fade_gain[i];
+  info[bank].fade_left = RETRIGGER_FADE;
+} /* voice_fadeout */
+
+void
+voice_release (int bank, double speed)
+{
+  /* hand the voice a preloaded bank is playing over to the
+     pool, it plays on there while the bank starts over */
+  voice_t *v, *oldest = NULL, *steal = NULL;
+  int i, held = 0;
+
+  for( i = 0; i < pool_count; i++ )
+    {
+      v = &voice_pool[pool_active[i]];
+
+      /* the oldest voice of all goes if the pool is full,
+	 one that's already on its way out if there is one */
+      if( (steal == NULL) || (!steal->fade_left && v->fade_left) ||
+	  ((!steal->fade_left == !v->fade_left) &&
+	   ((int) (v->age - steal->age) < 0)) )
+	steal = v;
+
+      if( (v->bank != bank) || v->fade_left )
+	continue;
+      held++;
+      if( (oldest == NULL) || ((int) (v->age - oldest->age) < 0) )
+	oldest = v;
+    }
+
+  /* over the bank's polyphony, its oldest voice lets go */
+  if( oldest && (held >= info[bank].polyphony - 1) )
+    {
+      if( RETRIGGER_FADE )
+	oldest->fade_left = RETRIGGER_FADE;
+      else
+	/* no fades, it's cut the next time it would play */
+	oldest->stops = info[bank].stops - 1;
+    }
+
+  if( pool_count < voice_pool_size )
+    {
+      for( i = 0; voice_pool[i].bank >= 0; i++ );
+      pool_active[pool_count++] = i;
+      v = &voice_pool[i];
+    }
+  else
+    v = steal;
+
+  v->bank = bank;
+  v->reverse = info[bank].reverse;
+  v->stops = info[bank].stops;
+  v->fade_left = 0;
+  v->age = voice_age++;
+  v->speed = speed;
+  v->ram = info[bank].ram;
+  v->pos = info[bank].ram_pos;
+  v->rs = voice_rs[bank];
+} /* voice_release */
+
+int
+voice_pool_render (voice_t *v, jack_nframes_t start, jack_nframes_t nframes)
+{
+  /* render nframes of a pool voice from frame 'start' of the
+     period on, like voice_render() does for a bank. returns 1
+     once it has nothing left to play */
+  thread_info_t *in = &info[v->bank];
+  float *src = voice_src + RESAMPLER_HISTORY;
+  jack_nframes_t offset;
+  int block, need, got, i;
+
+  /* the bank was stopped or given another soundfile */
+  if( (v->stops != in->stops) || (v->ram != in->ram) )
+    return 1;
+
+  for( offset = 0; offset < nframes; offset += block )
+    {
+      block = nframes - offset;
+      if( block > VOICE_BLOCK )
+	block = VOICE_BLOCK;
+
+      need = resampler_need(&v->rs, block, v->speed);
+      got = ram_fetch(in, &v->pos, v->reverse, src, need);
+      if( got < need )
+	resampler_end(&v->rs, got);
+      resampler_run(&v->rs, in->quality, voice_src, need,
+		    voice_buf, block, v->speed);
+
+      /* letting go, it's silent once the fade is over */
+      if( v->fade_left )
+	{
+	  for( i = 0; i < block; i++ )
+	    voice_buf[i] *= i < v->fade_left ? fade_gain[RETRIGGER_FADE - v->fade_left + i] : 0;
+	  v->fade_left = v->fade_left < block ? 0 : v->fade_left - block;
+	  mixer_block(outs, in->playback_mask, start + offset, voice_buf, block);
+	  if( v->fade_left == 0 )
+	    return 1;
+	  continue;
+	}
+
+      mixer_block(outs, in->playback_mask, start + offset, voice_buf, block);
+
+      if( resampler_done(&v->rs) )
+	return 1;
+    }
+
+  return 0;
+} /* voice_pool_render */
+
+int
+voice_start (int bank)
+{
+  /* switch a waiting voice over to the generation it waits for.
+     streamed banks skip whatever the queue holds from before
+     it, which costs the same no matter how much that is.
+     returns 1 if the voice can start playing */
+  thread_info_t *in = &info[bank];
+
+  if( in->ram )
+    in->ram_pos = in->reverse ? in->ram_frames - 1 : 0;
+  else if( head_info[bank].stream_from )
+    {
+      /* nothing to wait for, the queue catches up while
+	 the head of the file plays */
+      head_info[bank].pos = 0;
+      in->queue_wait = 1;
+    }
+  else
+    {
+      if( atomic_load_explicit(&in->generation_ready, memory_order_acquire) !=
+	  info[bank].voice_gen )
+	return 0;
+      rtqueue_seek(fifo_out[bank], in->generation_start);
+    }
+
+  resampler_reset(&voice_rs[bank]);
+  info[bank].waiting = 0;
+
+  return 1;
+} /* voice_start */
+
+int
+voice_render (int bank, jack_nframes_t start, jack_nframes_t nframes)
+{
+  /* render nframes of one voice, a block at a time, and mix
+     them into the output channels it is routed to from frame
+     'start' of the period on. returns 1 once the voice has
+     nothing left to play */
+  resampler_t *rs = &voice_rs[bank];
+  float *src = voice_src + RESAMPLER_HISTORY;
+  double speed = resampler_speed(info[bank].speedmult);
+  jack_nframes_t offset;
+  int block, need, got, i, fade, gen;
+  int eof = 0;
+
+  if( !info[bank].playing )
+    return 1;
+
+  /* ficus_playback() (re)started this bank */
+  gen = atomic_load(&info[bank].generation);
+  if( gen != info[bank].voice_gen )
+    {
+      if( !info[bank].waiting && (info[bank].polyphony > 1) &&
+	  info[bank].ram && (voice_pool_size > 0) )
+	voice_release(bank, speed);
+      else if( !info[bank].waiting && RETRIGGER_FADE )
+	voice_fadeout(bank, speed);
+      info[bank].voice_gen = gen;
+      info[bank].waiting = 1;
+    }
+
+  if( info[bank].waiting && voice_start(bank) &&
+      (atomic_load_explicit(&latency_probe[bank].state, memory_order_acquire) == PROBE_APPLIED) )
+    latency_probe[bank].hop[FICUS_LATENCY_DEQUEUE] = latency_frame_ns(start);
+
+  for( offset = 0; offset < nframes; offset += block )
+    {
+      block = nframes - offset;
+      if( block > VOICE_BLOCK )
+	block = VOICE_BLOCK;
+
+      if( info[bank].waiting )
+	/* stay quiet until the new generation is queued */
+	memset(voice_buf, 0, block * sample_size);
+      else
+	{
+	  /* source frames this block reads at the current speed */
+	  need = resampler_need(rs, block, speed);
+	  got = voice_source(bank, src, need, &eof);
+	  if( (got < need) && eof )
+	    resampler_end(rs, got);
+
+	  resampler_run(rs, info[bank].quality, voice_src, need,
+			voice_buf, block, speed);
+	}
+
+      /* mix in what's left of the voice this one replaced */
+      if( info[bank].fade_left )
+	{
+	  fade = info[bank].fade_left < block ? info[bank].fade_left : block;
+	  for( i = 0; i < fade; i++ )
+	    voice_buf[i] += VOICE_FADE(bank)[RETRIGGER_FADE - info[bank].fade_left + i];
+	  info[bank].fade_left -= fade;
+	}
+
+      /* add the block into the channels this bank is routed to */
+      mixer_block(outs, info[bank].playback_mask, start + offset, voice_buf, block);
+
+      /* a measured trigger is out once it's no longer silent */
+      if( !info[bank].waiting &&
+	  (atomic_load_explicit(&latency_probe[bank].state, memory_order_acquire) == PROBE_APPLIED) )
+	for( i = 0; i < block; i++ )
+	  if( voice_buf[i] != 0 )
+	    {
+	      latency_probe[bank].hop[FICUS_LATENCY_OUTPUT] = latency_frame_ns(start + offset + i);
+	      latency_finish(&latency_probe[bank]);
+	      break;
+	    }
+
+      if( !info[bank].waiting && resampler_done(rs) )
+	{
+	  /* unless it was retriggered in the meantime, this
+	     bank is done playing */
+	  if( atomic_load(&info[bank].generation) == info[bank].voice_gen )
+	    {
+	      info[bank].streaming = 0;
+	      info[bank].playing = 0;
+	    }
+	  return 1;
+	}
+    }
+
+  return 0;
+} /* voice_render */
+
+void
+voice_setup ()
+{
+  /* raised cosine for fading out retriggered voices */
+  int i;
+
+  for( i = 0; i < RETRIGGER_FADE; i++ )
+    fade_gain[i] = 0.5 * (1.0 + cos(M_PI * (i + 0.5) / RETRIGGER_FADE));
+} /* voice_setup */
+
+void
+transport_follow (jack_nframes_t now, jack_nframes_t nframes)
+{
+  /* count off the beats of JACK's transport that land in this
+     period. without BBT information the transport frame is
+     divided into beats at our own tempo */
+  jack_position_t pos;
+  double beat, last, frames_per_beat, bpm = transport_bpm;
+  jack_nframes_t frame;
+  int passed;
+
+  if( jack_transport_query(client, &pos) != JackTransportRolling )
+    return;
+
+  if( pos.valid & JackPositionBBT )
+    {
+      bpm = pos.beats_per_minute;
+      beat = (pos.bar - 1) * pos.beats_per_bar + (pos.beat - 1) +
+	pos.tick / pos.ticks_per_beat;
+    }
+  else
+    beat = pos.frame * bpm / (60.0 * jack_sr);
+
+  if( bpm <= 0 )
+    return;
+  frames_per_beat = jack_sr * 60.0 / bpm;
+
+  /* BBT may describe a frame a little into the period */
+  if( (pos.valid & JackPositionBBT) && (pos.valid & JackBBTFrameOffset) )
+    beat -= pos.bbt_offset / frames_per_beat;
+
+  /* beats that start within [beat, last) */
+  last = beat + nframes / frames_per_beat;
+  passed = (int) ceil(last) - (int) ceil(beat);
+  if( passed <= 0 )
+    return;
+
+  transport_count += passed;
+  frame = now + (jack_nframes_t) lround((ceil(last) - beat) * frames_per_beat);
+  atomic_store(&transport_position,
+	       (unsigned long long) transport_count << 32 | frame);
+  sem_post(&transport_sem);
+} /* transport_follow */
+
+void
+transport_timebase (jack_transport_state_t state, jack_nframes_t nframes,
+		    jack_position_t *pos, int new_pos, void *arg)
+{
+  /* as timebase master, fill in BBT for the period JACK is about
+     to run.  beats add up period by period so a tempo change 
+     carries on from where the last one left off */
+  double bpm = transport_bpm;
+  long whole;
+
+  if( new_pos || !timebase_valid )
+    timebase_beats = pos->frame * bpm / (60.0 * pos->frame_rate);
+  else
+    timebase_beats += (double) (pos->frame - timebase_frame) * bpm /
+      (60.0 * pos->frame_rate);
+  timebase_frame = pos->frame;
+  timebase_valid = 1;
+
+  whole = (long) timebase_beats;
+  pos->valid = JackPositionBBT;
+  pos->beats_per_bar = TIMEBASE_BEATS_PER_BAR;
+  pos->beat_type = 4;
+  pos->ticks_per_beat = TIMEBASE_TICKS;
+  pos->beats_per_minute = bpm;
+  pos->bar = whole / TIMEBASE_BEATS_PER_BAR + 1;
+  pos->beat = whole % TIMEBASE_BEATS_PER_BAR + 1;
+  pos->tick = (timebase_beats - whole) * TIMEBASE_TICKS;
+  pos->bar_start_tick = (double) (pos->bar - 1) * TIMEBASE_BEATS_PER_BAR * TIMEBASE_TICKS;
+} /* transport_timebase */
+
+void
+transport_advance (jack_nframes_t now, jack_nframes_t nframes)
+{
+  /* count off the steps that land in this period and work out
+     where the one after each lands, at the tempo as it is now */
+  jack_nframes_t frame;
+  int passed = 0;
+
+  switch( atomic_load_explicit(&transport_state, memory_order_acquire) )
+    {
+    case TRANSPORT_STOPPED:
+      return;
+    case TRANSPORT_STARTING:
+      transport_origin = transport_start;
+      transport_next = 0;
+      transport_count = 0;
+      atomic_store(&transport_state, TRANSPORT_ROLLING);
+      break;
+    }
+
+  if( transport_sync != FICUS_SYNC_INTERNAL )
+    {
+      transport_follow(now, nframes);
+      return;
+    }
+
+  while( 1 )
+    {
+      frame = transport_origin + (jack_nframes_t) (unsigned long long) transport_next;
+      if( (int) (frame - now) >= (int) nframes )
 	break;
-      rtqueue_deq(fifo_out[bank]);
+      transport_next += jack_sr * 60.0 / transport_bpm;
+      transport_count++;
+      passed++;
+    }
+
+  if( passed )
+    {
+      frame = transport_origin + (jack_nframes_t) (unsigned long long) transport_next;
+      atomic_store(&transport_position,
+		   (unsigned long long) transport_count << 32 | frame);
+      sem_post(&transport_sem);
     }
-  fifo_out_clear_amount[bank]=0;
-  return;
-} /* clear_fifo_out */
+} /* transport_advance */
 
-void *
-clear_fifo_out_thread ()
+void
+voices_render (jack_nframes_t start, jack_nframes_t nframes)
 {
-  int x;
-  for(x=0;x<NUM_SAMPLES;x++)
-    if(fifo_out_clear_sig[x])
+  /* render every active voice from frame 'start' of the
+     period on, dropping the ones that are done */
+  int v;
+
+  /* pick up banks that started playing since we last looked */
+  voice_collect();
+
+  for( v = 0; v < active_count; )
+    if( voice_render(active_voices[v], start, nframes) )
       {
-	samples_can_process[x]=0;
-	clear_fifo_out(x,fifo_out_clear_amount[x]);
-	fifo_out_clear_sig[x]=0;
-	info[x].user_interrupt=0;
+	/* done playing, drop it from the list */
+	info[active_voices[v]].listed = 0;
+	active_voices[v] = active_voices[--active_count];
       }
-  return;
-}
+    else
+      v++;
+
+  /* and the voices banks let go of */
+  for( v = 0; v < pool_count; )
+    if( voice_pool_render(&voice_pool[pool_active[v]], start, nframes) )
+      {
+	voice_pool[pool_active[v]].bank = -1;
+	pool_active[v] = pool_active[--pool_count];
+      }
+    else
+      v++;
+} /* voices_render */
+
+sf_count_t
+head_length (int bank)
+{
+  /* how much of a streamed bank's head the next trigger plays
+     from memory. none in reverse, where playback starts at the
+     other end of the file, and none of the crossfade at the end
+     of a loop, which only the streaming pool applies */
+  thread_info_t *in = &info[bank];
+  sf_count_t start, end, length = head_info[bank].frames;
+  int fade;
+
+  if( in->reverse || (head_info[bank].ram == NULL) )
+    return 0;
+
+  if( in->loop )
+    {
+      fade = loop_bounds(in, 0, sndfileinfo[bank].frames, &start, &end);
+      if( length > end - fade )
+	length = end - fade;
+    }
+
+  return length;
+} /* head_length */
+
+static inline int
+event_due (event_t *event, jack_nframes_t now)
+{
+  /* frames from now until an event is due, 0 if it's late */
+  int due = event->frame - now;
+
+  return due < 0 ? 0 : due;
+} /* event_due */
+
+void
+events_gather (jack_nframes_t now)
+{
+  /* move queued events into event_pending, keeping it sorted.
+     late events all count as due now, so commands keep the
+     order they were posted in. what doesn't fit stays queued
+     for a later period */
+  event_t event;
+  int i;
+
+  while( (event_count < EVENT_QUEUE) && evqueue_pop(events, &event) )
+    {
+      i = event_count++;
+      while( (i > 0) &&
+	     (event_due(&event_pending[i - 1], now) > event_due(&event, now)) )
+	{
+	  event_pending[i] = event_pending[i - 1];
+	  i--;
+	}
+      event_pending[i] = event;
+    }
+} /* events_gather */
 
-void *
-interrupt_clear_fifo_out (int sample_count)
+void
+load_swap (int bank)
+{
+  /* install the soundfile load_bank() has ready in
+     bank_load[bank] and stop the bank, pool voices and all.
+     its old memory goes back into bank_load[bank]. from
+     process(), unless process() has stopped for good */
+  thread_info_t *in = &info[bank];
+  head_info_t *hd = &head_info[bank];
+  bank_load_t *ld = &bank_load[bank];
+  float *ram = in->ram, *head = hd->ram;
+  sf_count_t ram_frames = in->ram_frames, head_frames = hd->frames;
+
+  in->playing = 0;
+  in->streaming = 0;
+  in->stops++;
+  in->ram = ld->ram;
+  in->ram_frames = ld->ram_frames;
+  in->ram_pos = ld->ram_frames;
+  hd->ram = ld->head;
+  hd->frames = ld->head_frames;
+  hd->stream_from = 0;
+  hd->pos = 0;
+  sndfileinfo[bank] = ld->sfinfo;
+
+  /* routing, looping and quality carry over to the new file,
+     loop points only make sense in the one they were set on.
+     generations keep counting so the streaming pool can't
+     mistake the next one for the last */
+  in->stream_eof = 0;
+  in->reverse = 0;
+  in->speedmult = 1.0;
+  in->rampup = 0.0;
+  in->rampdown = 0.0;
+  in->loop_start = 0;
+  in->loop_end = 0;
+  ld->generation = atomic_load(&in->generation);
+  atomic_store(&in->generation_ready, ld->generation);
+
+  ld->ram = ram;
+  ld->ram_frames = ram_frames;
+  ld->head = head;
+  ld->head_frames = head_frames;
+} /* load_swap */
+
+void
+event_apply (event_t *event)
 {
-  fifo_out_clear_amount[sample_count] = rtqueue_numrecords(fifo_out[sample_count]) + 1;
-  if( info[sample_count].user_interrupt )
+  /* carry out one event, from process(). this is the only
+     place the ficus_* mutators change engine state */
+  thread_info_t *in = &info[event->bank];
+
+  switch( event->type )
     {
-      fifo_out_clear_sig[sample_count]=1;
-      pthread_create (&fifo_out_clear_thread_id, NULL, clear_fifo_out_thread, NULL);
-      pthread_detach(fifo_out_clear_thread_id);
+    case FICUS_EVENT_TRIGGER:
+      /* every trigger starts a new generation of the bank. the
+	 voice fades out whatever the bank was playing and starts
+	 over, from memory right away if the bank is preloaded or
+	 the head of its file is, otherwise as soon as the
+	 streaming pool, woken up at the end of the period, has
+	 queued the start of the file */
+      if( !in->ram )
+	head_info[event->bank].stream_from = head_length(event->bank);
+      atomic_fetch_add(&in->generation, 1);
+      in->playing = 1;
+      /* ficus_playback() counted it as playing already */
+      if( event->arg )
+	{
+	  atomic_fetch_sub(&in->triggers_posted, 1);
+	  if( atomic_load_explicit(&latency_probe[event->bank].state, memory_order_acquire) == PROBE_DISPATCHED )
+	    {
+	      latency_probe[event->bank].hop[FICUS_LATENCY_APPLY] = latency_clock();
+	      atomic_store_explicit(&latency_probe[event->bank].state, PROBE_APPLIED,
+				    memory_order_release);
+	    }
+	}
+      if( !in->ram )
+	{
+	  in->streaming = 1;
+	  stream_hungry = 1;
+	}
+      voice_activate(event->bank);
+      break;
+    case FICUS_EVENT_STOP:
+      /* the voices it let go of stop with it */
+      in->playing = 0;
+      in->streaming = 0;
+      in->stops++;
+      break;
+    case FICUS_EVENT_SPEED:
+      in->reverse = event->value < 0;
+      in->speedmult = event->value < 0 ? -event->value : event->value;
+      break;
+    case FICUS_EVENT_MIXOUT:
+      if( event->value )
+	__sync_fetch_and_or(&in->playback_mask, 1u << event->arg);
+      else
+	__sync_fetch_and_and(&in->playback_mask, ~(1u << event->arg));
+      break;
+    case FICUS_EVENT_LOOP:
+      in->loop = event->value != 0;
+      break;
+    case FICUS_EVENT_LOOP_START:
+      in->loop_start = event->arg;
+      break;
+    case FICUS_EVENT_LOOP_END:
+      in->loop_end = event->arg;
+      break;
+    case FICUS_EVENT_LOOP_FADE:
+      in->loop_fade = event->arg;
+      break;
+    case FICUS_EVENT_MIXIN:
+      if( event->value )
+	__sync_fetch_and_or(&capture_mask[event->bank], 1u << event->arg);
+      else
+	__sync_fetch_and_and(&capture_mask[event->bank], ~(1u << event->arg));
+      break;
+    case FICUS_EVENT_RAMPUP:
+      in->rampup = event->value;
+      break;
+    case FICUS_EVENT_RAMPDOWN:
+      in->rampdown = event->value;
+      break;
+    case FICUS_EVENT_QUALITY:
+      in->quality = event->arg;
+      break;
+    case FICUS_EVENT_POLYPHONY:
+      in->polyphony = event->arg;
+      break;
+    case EVENT_LOAD:
+      /* nothing reads the bank's old memory after this, so
+	 load_bank() may free it once it sees the swap done */
+      load_swap(event->bank);
+      atomic_store_explicit(&bank_load[event->bank].done, event->arg,
+			    memory_order_release);
+      break;
+    }
+} /* event_apply */
+
+void
+stats_period (struct timespec *started)
+{
+  /* account for the time process() took this period */
+  struct timespec done;
+  unsigned long long ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &done);
+  ns = (done.tv_sec - started->tv_sec) * 1000000000ULL +
+    done.tv_nsec - started->tv_nsec;
+
+  if( atomic_exchange_explicit(&stats_reset, 0, memory_order_relaxed) )
+    {
+      atomic_store_explicit(&stats_ns_sum, 0, memory_order_relaxed);
+      atomic_store_explicit(&stats_ns_count, 0, memory_order_relaxed);
+      atomic_store_explicit(&stats_ns_min, ns, memory_order_relaxed);
+      atomic_store_explicit(&stats_ns_max, ns, memory_order_relaxed);
     }
-  return;
-} /* interrupt_clear_fifo_out */
+
+  if( ns < atomic_load_explicit(&stats_ns_min, memory_order_relaxed) )
+    atomic_store_explicit(&stats_ns_min, ns, memory_order_relaxed);
+  if( ns > atomic_load_explicit(&stats_ns_max, memory_order_relaxed) )
+    atomic_store_explicit(&stats_ns_max, ns, memory_order_relaxed);
+  atomic_store_explicit(&stats_ns_sum,
+			atomic_load_explicit(&stats_ns_sum, memory_order_relaxed) + ns,
+			memory_order_relaxed);
+  atomic_store_explicit(&stats_ns_count,
+			atomic_load_explicit(&stats_ns_count, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+  atomic_store_explicit(&stats_periods,
+			atomic_load_explicit(&stats_periods, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+} /* stats_period */
 
 static int
 process(jack_nframes_t nframes, void * arg)
@@ -176,76 +1409,225 @@ process(jack_nframes_t nframes, void * arg)
   /* this is the function to be registered as 
      the JACK process() callback.  
 
-     for every frame in this period, we queue channel data to
-     JACK's input ports and send queued channel data
-     thru JACK's output ports for every soundfile 
-     loaded into the system.
+     every period we queue channel data from JACK's input 
+     ports and, for every voice that's currently playing,
+     render a block of audio and send it thru JACK's output
+     ports.  banks that aren't playing cost us nothing.
   */
 
-  float sample; 
-  unsigned i, n, x; 
-  int sample_count = 0;
+  jack_nframes_t now = render_offline ? render_time : jack_last_frame_time(client);
+  jack_nframes_t offset, next;
+  struct timespec started;
+  unsigned i, n;
+  int due, e;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  period_ns = started.tv_sec * 1000000000ULL + started.tv_nsec;
 
-  /* allocate all output buffers */
-  for(i = 0; i < NUM_CHANNELS; i++)
+  /* allocate all output buffers. offline, outs and ins
+     always point at ficus_render()'s buffers */
+  for(i = 0; i < num_channels; i++)
     {
-      outs [i] = jack_port_get_buffer (output_port[i], nframes);
+      if( !render_offline )
+	outs [i] = jack_port_get_buffer (output_port[i], nframes);
       memset(outs[i], 0, nframes * sample_size);
-      if( capture_thread_isrunning )
+      if( capture_thread_isrunning && !render_offline )
 	ins [i] = jack_port_get_buffer (input_port[i], nframes);
     }
 
-  for ( i = 0; i < nframes; i++)
+  if( capture_thread_isrunning == 1)
+    /* Queue incoming audio in case it needs to go to the disk,
+       whatever doesn't fit is lost */
+    for (n = 0; n < num_channels; n++)
+      overruns += nframes - rtqueue_enq_n(fifo_in[n], ins[n], nframes);
+
+  transport_advance(now, nframes);
+
+  /* split the period at every event that's due in it, so each
+     one happens on its frame. late events happen right away */
+  events_gather(now);
+  for( offset = 0, e = 0; offset < nframes; offset = next )
     {
-      if( capture_thread_isrunning == 1)
-	/* Queue incoming audio in case it needs to go to the disk */
+      while( (e < event_count) &&
+	     ((int) (event_pending[e].frame - (now + offset)) <= 0) )
+	event_apply(&event_pending[e++]);
 
-	for (n = 0; n < NUM_CHANNELS; n++)
-	  rtqueue_enq(fifo_in[n], ins[n][i]);
-      
-      for (sample_count = 0; sample_count < NUM_SAMPLES; sample_count++)
+      next = nframes;
+      if( e < event_count )
 	{
-	  sample = 0;	
+	  due = event_pending[e].frame - now;
+	  if( due < (int) nframes )
+	    next = due;
+	}
 
-	  if( samples_can_process[sample_count] ) 
-	    {
-	      /* Has this queue run out of audio to process? */
-	      if ( rtqueue_isempty(fifo_out[sample_count]) 
-		   && samples_can_process[sample_count])
-		{
-		  /* If yes, zero out this sample's buffers for this frame */ 
-		  sample = 0;
-		  samples_can_process[sample_count] = 0;
-		  
-		  /* if this sample is waiting for its buffer to empty, signal it */
-		  if( samples_finished_playing[sample_count] )
-		    pthread_cond_signal(&samples_finished_playing_cond[sample_count]);
-		}
-	      else
-		/* The disk_thread says there's audio to process, let's check */
-		if (samples_can_process[sample_count]) //&& (info[sample_count].user_interrupt==0))
-		  {
-		    if( info[sample_count].user_interrupt == 0 )
-		      /* If so, dequeue a frame for this sample */
-		      sample = rtqueue_deq(fifo_out[sample_count]);
-	    
-		    /* signal the disk thread to keep reading from disk */
-		    pthread_cond_signal(&samples_wait_process_cond[sample_count]);
-		  }
+      voices_render(offset, next - offset);
+    }
 
-	      for(n = 0; n < NUM_CHANNELS; n++)
-		{
-		  /* Check to make sure we can output thru this channel, then do/don't */
-		  if(playback_mix[sample_count][n] == 1)
-		    outs[n][i] += sample;
-		}
-	    }
+  /* keep the events that are due in later periods */
+  event_count -= e;
+  memmove(event_pending, event_pending + e, event_count * sizeof(event_t));
+
+  /* wake a streaming worker, without blocking, if one 
+     of our voices wants more audio */
+  if( stream_hungry )
+    {
+      stream_hungry = 0;
+      atomic_fetch_add(&stream_work, 1);
+      if( pthread_mutex_trylock(&stream_wait_mutex) == 0 )
+	{
+	  pthread_cond_signal(&stream_wait_cond);
+	  pthread_mutex_unlock(&stream_wait_mutex);
 	}
     }
+
+  stats_period(&started);
+  process_cycles++;
   
   return 0 ;
 } /* process */
+
+void
+events_flush ()
+{
+  /* offline, apply the events that are due now rather than
+     leave them for the next ficus_render(), where they'd be
+     the first thing process() does anyway */
+  int e;
+
+  pthread_mutex_lock(&render_mutex);
+  events_gather(render_time);
+  for( e = 0; (e < event_count) &&
+	 ((int) (event_pending[e].frame - render_time) <= 0); e++ )
+    event_apply(&event_pending[e]);
+  event_count -= e;
+  memmove(event_pending, event_pending + e, event_count * sizeof(event_t));
+  pthread_mutex_unlock(&render_mutex);
+} /* events_flush */
 //
+int load_bank(char *path, int bank_number, float *ram, sf_count_t ram_frames);
+int preload_reserve(int bank_number, sf_count_t frames, sf_count_t held);
+void preload_unreserve(sf_count_t frames);
+void wait_process_cycles();
+
+void
+capture_keep (int bank, float *buf, int nframes)
+{
+  /* hold on to captured audio so it can become the bank's
+     playback source without reading it back from disk. 
+     gives up if the capture outgrows what the bank may 
+     preload, the soundfile is loaded as usual then */
+  thread_info_in_t *in = &info_in[bank];
+  sf_count_t size = in->ram_size;
+  float *ram = NULL;
+
+  if( !in->keep_ram )
+    return;
+
+  if( in->total_captured + nframes > size )
+    {
+      if( size == 0 )
+	size = CAPTURE_BLOCK * 16;
+      while( in->total_captured + nframes > size )
+	size *= 2;
+
+      /* the memory is charged to the budget up front, and
+	 64-byte aligned like every other preloaded bank */
+      if( preload_reserve(bank, size, in->ram_size) == 0 )
+	{
+	  if( posix_memalign((void **) &ram, 64, size * sample_size) )
+	    {
+	      preload_unreserve(size - in->ram_size);
+	      ram = NULL;
+	    }
+	}
+      if( ram == NULL )
+	{
+	  preload_unreserve(in->ram_size);
+	  free(in->ram);
+	  in->ram = NULL;
+	  in->ram_size = 0;
+	  in->keep_ram = 0;
+	  return;
+	}
+      if( in->ram )
+	memcpy(ram, in->ram, in->total_captured * sample_size);
+      free(in->ram);
+      in->ram = ram;
+      in->ram_size = size;
+    }
+
+  memcpy(in->ram + in->total_captured, buf, nframes * sample_size);
+} /* capture_keep */
+
+void
+capture_finish (int bank, int failed)
+{
+  /* close a finished capture, which also completes its 
+     soundfile's header, move it over the bank's soundfile
+     and make it what the bank plays. then let the world
+     know it's done */
+  thread_info_in_t *in = &info_in[bank];
+
+  sf_close (in->sndfile) ;
+  in->sndfile = NULL;
+
+  if( failed || (in->total_captured == 0) )
+    {
+      /* leave the bank as it was */
+      unlink(in->tmp_path);
+      preload_unreserve(in->ram_size);
+      free(in->ram);
+    }
+  else
+    {
+      /* the soundfile on disk is replaced in one step, nobody
+	 ever gets to see it half written */
+      rename(in->tmp_path, in->path);
+      if( in->keep_ram )
+	{
+	  /* the bank is charged for what it plays, not for
+	     what the buffer had room for */
+	  preload_unreserve(in->ram_size - in->total_captured);
+	  load_bank(in->path, bank, in->ram, in->total_captured);
+	}
+      else
+	{
+	  preload_unreserve(in->ram_size);
+	  free(in->ram);
+	  load_bank(in->path, bank, NULL, 0);
+	}
+    }
+
+  in->ram = NULL;
+  in->ram_size = 0;
+  in->keep_ram = 0;
+  in->total_captured = 0;
+  in->kill = 0;
+  in->can_capture = 0;
+  capture_record[bank] = 0;
+} /* capture_finish */
+
+int
+capture_armed ()
+{
+  /* returns 1 if any bank wants to capture */
+  int c;
+
+  for (c=0; c < num_banks; c++)
+    if (info_in[c].can_capture == 1)
+      return 1;
+  return 0;
+} /* capture_armed */
+
+void
+capture_wake ()
+{
+  /* start the capture thread if it's sleeping */
+  pthread_mutex_lock(&capture_thread_wait_mutex);
+  pthread_cond_signal(&capture_thread_wait_cond);
+  pthread_mutex_unlock(&capture_thread_wait_mutex);
+} /* capture_wake */
+
 void * 
 disk_thread_in (void *arg)
 {
@@ -253,358 +1635,584 @@ disk_thread_in (void *arg)
      audio data and writing to it to disk.
 
      there is only 1 instance of these run for every 
-     libficus (JACK) client.
+     libficus (JACK) client.  it takes up to CAPTURE_BLOCK
+     frames of every input channel at once, sums the 
+     channels each capturing bank listens to and writes
+     the whole block to that bank's soundfile.
   */
 
-  float channelbuf[NUM_CHANNELS];
-  float *framebuf = (float *) malloc (sizeof(4));
+  static float framebuf[CAPTURE_BLOCK] __attribute__((aligned(64)));
+  float *channelbuf;
+  float *channels[MAX_CHANNELS];
+
+  int i, c = 0;
+  int frames, write_count, count;
 
-  int i, c, n = 0;
-  int write_count;
-  int wrote_to_file;
+  if (posix_memalign((void **) &channelbuf, 64, sample_size * CAPTURE_BLOCK * num_channels))
+    return 0;
   
-  capture_thread_isrunning = 1;
+  for (i=0; i < num_channels; i++)
+    channels[i] = channelbuf + i * CAPTURE_BLOCK;
 
   while (1)
     {
-      for (i=0; i < NUM_CHANNELS; i++)
-	channelbuf[i] = rtqueue_deq(fifo_in[i]);
+      if (!capture_armed())
+	{
+	  /* nothing to capture. once process() stops queueing
+	     input, give the queues' memory back to the pool */
+	  if (capture_thread_isrunning)
+	    {
+	      capture_thread_isrunning = 0;
+	      wait_process_cycles();
+	      for (i=0; i < num_channels; i++)
+		rtqueue_detach(fifo_in[i]);
+	    }
+
+	  /* sleep until ficus_capture() */
+	  pthread_mutex_lock(&capture_thread_wait_mutex);
+	  while (!capture_armed())
+	    pthread_cond_wait(&capture_thread_wait_cond, &capture_thread_wait_mutex);
+	  pthread_mutex_unlock(&capture_thread_wait_mutex); 
+	}
+
+      if (!capture_thread_isrunning)
+	{
+	  /* borrow the input queues, freshly emptied, before
+	     process() starts filling them */
+	  for (i=0; i < num_channels; i++)
+	    if (rtqueue_attach(fifo_in[i], IN_FRAMES))
+	      break;
+
+	  if (i < num_channels)
+	    {
+	      /* the pool is spent, fail the captures instead */
+	      while (i--)
+		rtqueue_detach(fifo_in[i]);
+	      for (c=0; c < num_banks; c++)
+		if (info_in[c].can_capture == 1)
+		  {
+		    capture_finish(c, 1);
+		    info_in[c].status = ENOMEM;
+		  }
+	      continue;
+	    }
+	  capture_thread_isrunning = 1;
+	}
 
-      wrote_to_file = 0;
+      /* process() queues the last channel last, once it has a
+	 block the others do too. we don't wait for long so the
+	 end of a capture and killed captures aren't held up */
+      rtqueue_wait_records(fifo_in[num_channels - 1], CAPTURE_BLOCK);
+      frames = rtqueue_numrecords(fifo_in[num_channels - 1]);
+      if (frames > CAPTURE_BLOCK)
+	frames = CAPTURE_BLOCK;
+
+      for (i=0; i < num_channels; i++)
+	rtqueue_deq_n(fifo_in[i], channels[i], frames);
 
       /* number of banks we could possibly record to */
-      for (c=0; c < NUM_SAMPLES; c++)
+      for (c=0; c < num_banks; c++)
 	{
 	  /* if the sample is selected to write to disk,
-	     write the buffered sample */
-	  if (info_in[c].can_capture == 1)
+	     write the buffered block */
+	  if (info_in[c].can_capture != 1)
+	    continue;
+
+	  /* let the world know that we're writing captured audio data */
+	  capture_record[c] = 1;
+
+	  if (info_in[c].kill == 1)
 	    {
-	      wrote_to_file = 1;
+	      capture_finish(c, 0);
+	      continue;
+	    }
 
-	      /* let the world know that we're writing captured audio data */
-	      active_file_record[1][c] = 1;
-	      info_in[c].status = 0;
-	      write_count = 0;
-	      framebuf[0] = (float) 0;
-	      
-	      for (n=0; n < NUM_CHANNELS; n++)
-		if ( capture_mix[c][n] == 1 )
-		    framebuf[0] += channelbuf[n];
+	  /* don't write past the duration we were asked for */
+	  count = frames;
+	  if (count > info_in[c].duration - info_in[c].total_captured)
+	    count = info_in[c].duration - info_in[c].total_captured;
+
+	  /* sum the channels this bank captures */
+	  mixer_sum(framebuf, channels, capture_mask[c], count);
 	      
-	      write_count = sf_writef_float (info_in[c].sndfile, framebuf, 1);	      
+	  write_count = sf_writef_float (info_in[c].sndfile, framebuf, count);
 	      
-	      if (write_count != 1)
-		{
-		  char errstr[256];
-		  sf_error_str (0, errstr, sizeof (errstr) - 1);
-
-		  info_in[c].status = EIO; /* write failed */ 
-		  info_in[c].can_capture = 0;
-		  active_file_record[1][c] = 0;
-		}
+	  if (write_count != count)
+	    {
+	      char errstr[256];
+	      sf_error_str (0, errstr, sizeof (errstr) - 1);
+
+	      capture_finish(c, 1);
+	      info_in[c].status = EIO; /* write failed */ 
+	      continue;
+	    }
 	      
-	      /* if the write was successful, we keep track of how much 
-		 we actually did write vs. how much we expected to write */
-	      if (info_in[c].status != EIO)
-		{
-		  info_in[c].total_captured += write_count;
-		  
-		  /* stop writing to this soundfile if we've written enough data */
-		  if ( (info_in[c].total_captured >= info_in[c].duration) || (info_in[c].kill == 1) )
-		    {
-		      active_file_record[1][c] = 0;
-		      info_in[c].can_capture = 0;
-		      info_in[c].total_captured = 0;
-		      info_in[c].kill = 0;
-		    }
-		}
+	  /* keep track of how much we actually did write vs. 
+	     how much we expected to write */
+	  capture_keep(c, framebuf, write_count);
+	  info_in[c].total_captured += write_count;
+	  
+	  /* once in a while, check our jack overruns, only the
+	     ones since this capture armed are its own */
+	  if (overruns > info_in[c].overruns_armed)
+	    info_in[c].status = EPIPE;
+	  
+	  /* stop writing to this soundfile if we've written enough data */
+	  if (info_in[c].total_captured >= info_in[c].duration)
+	    capture_finish(c, 0);
+	}
+    }
+  
+  return 0;
+} /* disk_thread_in */
+
+int
+stream_fill_at (stream_info_t *st, sf_count_t start)
+{
+  /* read the block of frames from 'start' on into the staging
+     buffer. returns 1 if there's none */
+  st->stream_count = 0;
+  /* an empty bank, its soundfile wouldn't open */
+  if( st->sndfile == NULL )
+    return 1;
+  if( sf_seek(st->sndfile, start, SEEK_SET) < 0 )
+    return 1;
+
+  st->stream_start = start;
+  st->stream_count = sf_readf_float(st->sndfile, st->stream_buf, STREAM_FRAMES);
+  if( st->stream_count <= 0 )
+    {
+      st->stream_count = 0;
+      return 1;
+    }
+
+  return 0;
+} /* stream_fill_at */
+
+int
+stream_fill (int bank, sf_count_t pos)
+{
+  /* refill the staging buffer so that it holds frame 'pos'.
+     playing forward we put 'pos' at the head of the block,
+     playing in reverse we put it at the tail, so either way
+     the block lasts as long as possible before the next read */
+  sf_count_t start = pos;
+
+  if( info[bank].reverse )
+    {
+      start = pos - STREAM_FRAMES + 1;
+      if( start < 0 )
+	start = 0;
+    }
+
+  return stream_fill_at(&stream_info[bank], start);
+} /* stream_fill */
+
+sf_count_t
+stream_frame (int bank, sf_count_t pos, float *frame)
+{
+  /* fetch the frame at 'pos' from the staging buffer, only
+     touching the disk when 'pos' has moved outside of it.
+     returns the number of frames fetched, 0 at end of file */
+  stream_info_t *st = &stream_info[bank];
+
+  /* mapped files have no need for the staging buffer */
+  if( st->wavmap )
+    {
+      if( (pos < 0) || (pos >= st->wavmap->frames) )
+	return 0;
+      frame[0] = wavmap_frame(st->wavmap, pos);
+      return 1;
+    }
+
+  if( (pos < st->stream_start) ||
+      (pos >= st->stream_start + st->stream_count) )
+    if( stream_fill(bank, pos) ||
+	(pos < st->stream_start) ||
+	(pos >= st->stream_start + st->stream_count) )
+      return 0;
+
+  /* multichannel files are played from their first channel */
+  frame[0] = st->stream_buf[(pos - st->stream_start) * st->channels];
+
+  return 1;
+} /* stream_frame */
+
+int
+stream_fade_load (int bank, int reverse, sf_count_t start, sf_count_t end, int fade)
+{
+  /* keep the frames a streamed loop crossfades with in a buffer
+     of their own. they're a whole loop away from the frames
+     playing and would have the staging buffer going back and
+     forth to the disk otherwise.  they're only read again when
+     the loop changes. returns how long the crossfade can be,
+     0 if there's no memory for it */
+  stream_info_t *st = &stream_info[bank];
+  sf_count_t first = reverse ? end : start - fade;
+  int i;
+
+  if( (first == st->fade_first) && (fade == st->fade_frames) )
+    return fade;
+
+  if( (st->fade_buf == NULL) &&
+      ((st->fade_buf = (float *) malloc (sample_size * LOOP_FADE_MAX)) == NULL) )
+    return 0;
+
+  for( i = 0; i < fade; i++ )
+    if( stream_frame(bank, first + i, st->fade_buf + i) == 0 )
+      st->fade_buf[i] = 0;
+
+  st->fade_first = first;
+  st->fade_frames = fade;
+
+  return fade;
+} /* stream_fade_load */
+
+static inline sf_count_t
+stream_run (thread_info_t *in, sf_count_t frames, sf_count_t start,
+	    sf_count_t end, int fade, sf_count_t pos)
+{
+  /* frames a bank playing forward from 'pos' plays straight
+     thru, before the loop's crossfade or its last frame */
+  if( in->loop && (pos < end) )
+    return end - (fade ? fade : 1) - pos;
+
+  return frames - pos;
+} /* stream_run */
+
+int
+stream_read (int bank, float *buf, int nframes)
+{
+  /* copy the next nframes of a streamed bank into buf, in the
+     order they're played, starting over at the other end if the
+     bank loops. returns how many frames there were, less than
+     nframes once the end of the soundfile is reached */
+  thread_info_t *in = &info[bank];
+  stream_info_t *st = &stream_info[bank];
+  sf_count_t frames = sndfileinfo[bank].frames;
+  sf_count_t start, end, partner, run, k;
+  float gain_out, gain_in;
+  int i, fade;
+
+  fade = loop_bounds(in, in->reverse, frames, &start, &end);
+  if( fade )
+    fade = stream_fade_load(bank, in->reverse, start, end, fade);
+
+  for( i = 0; i < nframes; i++ )
+    {
+      /* fell off either end of the soundfile */
+      if( (st->pos < 0) || (st->pos >= frames) )
+	{
+	  if( in->loop && (frames > 0) )
+	    st->pos = in->reverse ? end - 1 : start;
+	  else
+	    return i;
+	}
+
+      /* playing a mapped file forward, convert everything up
+	 to the next frame the loop has to look after at once */
+      if( st->wavmap && !in->reverse &&
+	  ((run = stream_run(in, frames, start, end, fade, st->pos)) > 1) )
+	{
+	  if( run > nframes - i )
+	    run = nframes - i;
+	  run = wavmap_read(st->wavmap, st->pos, buf + i, run);
+	  if( in->rampup || in->rampdown )
+	    for( k = 0; k < run; k++ )
+	      buf[i + k] *= ramp_factor(in, 0, frames, st->pos + k);
+	  st->pos += run;
+	  i += run - 1;
+	  continue;
+	}
+
+      /* the staging buffer only goes to the disk every
+	 STREAM_FRAMES frames */
+      if( stream_frame(bank, st->pos, buf + i) == 0 )
+	return i;
+
+      /* the end of the loop fades into its start */
+      if( fade &&
+	  ((partner = loop_partner(in->reverse, start, end, fade, st->pos,
+				   &gain_out, &gain_in)) >= 0) )
+	buf[i] = buf[i] * gain_out + st->fade_buf[partner - st->fade_first] * gain_in;
+
+      /*
+	AMPLITUDE RAMPING
+      */
+      buf[i] *= ramp_factor(in, in->reverse, frames, st->pos);
+
+      st->pos = loop_next(in, in->reverse, start, end, st->pos);
+    }
+
+  return nframes;
+} /* stream_read */
+
+int
+stream_pick ()
+{
+  /* find the bank that needs the disk the most and claim it.
+     a retriggered bank goes first, then the bank with the 
+     least audio queued. returns -1 if nobody needs us */
+  int bank, best, fill, best_fill;
+
+  do
+    {
+      best = -1;
+      best_fill = 0;
+      for( bank = 0; bank < num_banks; bank++ )
+	{
+	  if( !info[bank].streaming || atomic_load(&stream_info[bank].claimed) )
+	    continue;
+
+	  if( atomic_load(&info[bank].generation) != stream_info[bank].generation_seen )
+	    fill = -1;
+	  else if( info[bank].stream_eof ||
+		   (rtqueue_space(fifo_out[bank]) < QUEUE_REFILL) )
+	    continue;
+	  else
+	    fill = rtqueue_numrecords(fifo_out[bank]);
+
+	  if( (best < 0) || (fill < best_fill) )
+	    {
+	      best = bank;
+	      best_fill = fill;
 	    }
 	}
-      /* once in a while, check our jack overruns */
-      if (overruns > 0)
-	info_in[c].status = EPIPE;
 
-      if (wrote_to_file == 0) 
+      if( best < 0 )
+	return -1;
+    }
+  /* another worker beat us to it, look again */
+  while( atomic_exchange(&stream_info[best].claimed, 1) );
+
+  return best;
+} /* stream_pick */
+
+void
+stream_hint (int bank, sf_count_t pos, sf_count_t nframes)
+{
+  /* have the kernel start reading frames [pos, pos + nframes)
+     of a bank's soundfile into the page cache, without waiting
+     for them. libsndfile doesn't say where a frame is in the
+     file, for those the position is scaled to the file size,
+     which is close enough for anything but wildly varying
+     bit rates */
+  stream_info_t *st = &stream_info[bank];
+  sf_count_t frames = sndfileinfo[bank].frames;
+
+  if( nframes <= 0 )
+    return;
+
+  if( st->wavmap )
+    wavmap_prefetch(st->wavmap, pos, nframes);
+  else if( (st->hint_fd >= 0) && (frames > 0) && (st->hint_size > 0) )
+    posix_fadvise(st->hint_fd, (off_t) ((double) pos / frames * st->hint_size),
+		  (off_t) ((double) nframes / frames * st->hint_size) + 1,
+		  POSIX_FADV_WILLNEED);
+} /* stream_hint */
+
+void
+stream_prefetch (int bank)
+{
+  /* ask for the next prefetch_frames a streaming bank plays,
+     in the direction it plays and around the loop, to be read
+     in the background. every bank's reads queue up in the
+     kernel together, so the disk can merge and reorder them
+     rather than serving one blocked worker at a time.  a bank
+     only asks again once it has played through half of what
+     it asked for */
+  thread_info_t *in = &info[bank];
+  stream_info_t *st = &stream_info[bank];
+  sf_count_t frames = sndfileinfo[bank].frames;
+  sf_count_t ahead = prefetch_frames;
+  sf_count_t start, end, lo, hi, pos = st->pos;
+
+  if( (ahead <= 0) || (pos < 0) || (pos >= frames) ||
+      ((st->prefetch_pos >= 0) &&
+       (llabs(pos - st->prefetch_pos) < ahead / 2)) )
+    return;
+
+  st->prefetch_pos = pos;
+  loop_bounds(in, in->reverse, frames, &start, &end);
+
+  if( in->reverse )
+    {
+      lo = (in->loop && (pos >= start)) ? start : 0;
+      if( pos - lo + 1 > ahead )
+	lo = pos - ahead + 1;
+      stream_hint(bank, lo, pos - lo + 1);
+      /* and what comes after the loop starts over */
+      if( in->loop && (pos >= start) )
+	stream_hint(bank, end - (ahead - (pos - lo + 1)),
+		    ahead - (pos - lo + 1));
+    }
+  else
+    {
+      hi = (in->loop && (pos < end)) ? end : frames;
+      if( hi - pos > ahead )
+	hi = pos + ahead;
+      stream_hint(bank, pos, hi - pos);
+      if( in->loop && (pos < end) )
+	stream_hint(bank, start, ahead - (hi - pos));
+    }
+} /* stream_prefetch */
+
+void
+stream_service (int bank, float *buf)
+{
+  /* give a claimed bank one refill's worth of audio */
+  thread_info_t *in = &info[bank];
+  stream_info_t *st = &stream_info[bank];
+  sf_count_t start, end;
+  int space, got;
+
+  /* ficus_playback() (re)started this bank. rewind to the
+     beginning of the file, or to the end if playback is reversed,
+     and tell process() where in the queue the new audio starts.
+     it skips whatever's queued before that by itself */
+  if( atomic_load(&in->generation) != st->generation_seen )
+    {
+      st->generation_seen = atomic_load(&in->generation);
+      if( head_info[bank].stream_from )
 	{
-	  capture_thread_isrunning = 0;
-	  pthread_mutex_lock(&capture_thread_wait_mutex);
-	  pthread_cond_wait(&capture_thread_wait_cond, &capture_thread_wait_mutex);
-	  pthread_mutex_unlock(&capture_thread_wait_mutex); 
-	  capture_thread_isrunning = 1;
+	  /* process() is playing the head of the file already,
+	     read on from the frame that follows it */
+	  loop_bounds(in, 0, sndfileinfo[bank].frames, &start, &end);
+	  st->pos = loop_next(in, 0, start, end, head_info[bank].stream_from - 1);
 	}
+      else
+	st->pos = in->reverse ? sndfileinfo[bank].frames - 1 : 0;
+      in->stream_eof = 0;
+      st->prefetch_pos = -1;
+
+      /* borrow queue memory for the bank. if the pool is spent
+	 the voice starts and ends quietly instead */
+      if( !rtqueue_isattached(fifo_out[bank]) &&
+	  rtqueue_attach(fifo_out[bank], OUT_FRAMES) )
+	{
+	  fprintf(stderr, "ficus: queue pool exhausted, can't stream bank %d\n", bank);
+	  in->stream_eof = 1;
+	}
+      in->generation_start = rtqueue_mark(fifo_out[bank]);
+      atomic_store_explicit(&in->generation_ready, st->generation_seen,
+			    memory_order_release);
     }
-  
-  return 0;
-} /* disk_thread_in */
 
-int random_in_range (unsigned int min, unsigned int max)
+  if( !in->streaming || in->stream_eof )
+    return;
+
+  space = rtqueue_space(fifo_out[bank]);
+  if( space > QUEUE_REFILL )
+    space = QUEUE_REFILL;
+
+  stream_prefetch(bank);
+  got = stream_read(bank, buf, space);
+  rtqueue_enq_n(fifo_out[bank], buf, got);
+
+  if( (atomic_load_explicit(&latency_probe[bank].state, memory_order_acquire) == PROBE_APPLIED) &&
+      (latency_probe[bank].hop[FICUS_LATENCY_ENQUEUE] == 0) )
+    latency_probe[bank].hop[FICUS_LATENCY_ENQUEUE] = latency_clock();
+
+  /* let process() know there's nothing more coming, after
+     the audio itself is visible to it */
+  if( got < space )
+    {
+      atomic_thread_fence(memory_order_release);
+      in->stream_eof = 1;
+    }
+
+  /* signal process thread there is data to process 
+     from this sample bank */
+  voice_activate(bank);
+} /* stream_service */
+
+void
+stream_release_idle ()
 {
-  int base_random = rand();
-  if (RAND_MAX == base_random) return random_in_range(min, max);
-  int range       = max - min,
-    remainder   = RAND_MAX % range,
-    bucket      = RAND_MAX / range;
-  if (base_random < RAND_MAX - remainder) {
-    return min + base_random/bucket;
-  } else {
-    return random_in_range (min, max);
-  }
-}
+  /* give the queue memory of banks that stopped streaming
+     back to the pool, once process() is done reading it */
+  int bank;
+
+  for( bank = 0; bank < num_banks; bank++ )
+    {
+      if( info[bank].streaming || !rtqueue_isattached(fifo_out[bank]) ||
+	  atomic_exchange(&stream_info[bank].claimed, 1) )
+	continue;
+
+      if( !info[bank].streaming )
+	{
+	  wait_process_cycles();
+	  if( !info[bank].streaming )
+	    rtqueue_detach(fifo_out[bank]);
+	}
+      atomic_store(&stream_info[bank].claimed, 0);
+    }
+} /* stream_release_idle */
 
 static void *
-disk_thread (void *arg)
+stream_worker (void *arg)
 {
 
-  /* disk_thread() is the thread responsible for 
-     playback of JACK audio data.
+  /* stream_worker() is one of the threads responsible 
+     for playback of soundfiles that aren't preloaded.
 
-     for every call to ficus_playback(), an
-     instance of this thread is started for the
-     given sample bank. the hope is that the 
-     operating system can allocate resources
-     for these threads better than i can.
+     there is a small fixed pool of these, started by
+     ficus_setup().  each one keeps picking whichever
+     playing bank has the least audio queued and reads
+     it another QUEUE_REFILL frames from disk, so
+     triggering a bank never has to start a thread.
+     arg is its QUEUE_REFILL frame slice of stream_worker_buf.
   */
 
-  int sample_num = (int ) arg ;
-
-  sf_count_t read_frames ;
-  float buf_out[1];
-  
-  int count = 0;
-  int count1 = 0;
-  int count2 = 0;
-  float ramplength = 0;
-  float rampstart = 0;
-  float volume_factor = 0;
+  float *buf = (float *) arg ;
+  struct timespec timeout;
+  unsigned int work;
+  int bank;
 
-  float slow_speedmult=0.0;
- 
-  do
+  while( stream_workers_run )
     {
-      do
-	{ 
-	  /* seek to beginning of file, if playback is reversed seek to the end */
-	  if(info[sample_num].reverse)
-	    {
-	      sf_seek(info[sample_num].sndfile, sndfileinfo[sample_num].frames-1, SEEK_SET);
-	      info[sample_num].pos=sndfileinfo[sample_num].frames-1; 
-	    }
-	  else
-	    {
-	      sf_seek(info[sample_num].sndfile, 0, SEEK_SET);
-	      info[sample_num].pos=0;
-	    }
-	  while (1)
-	    { 
-	      read_frames=0;
-	      /* kill playback for this sample? */
-	      /* we have to do this again so that loop_state
-		 doesn't keep us in this do-while{} */
-	      if( info[sample_num].kill == 1 )
-		{
-		  active_file_record[0][info[sample_num].bank_number] = 0;
-		  break;
-		}  
-	      
-	      /* if the queue IS full and we're just waiting on the process callback(),
-	       we wait until space has been made */
-	      if ( (rtqueue_isfull(fifo_out[info[sample_num].bank_number]) == 1) )
-		{
-		  samples_wait_process[sample_num] = 1;
-		  pthread_mutex_lock(&samples_wait_process_mutex[sample_num]);
-		  pthread_cond_wait(&samples_wait_process_cond[sample_num], &samples_wait_process_mutex[sample_num]);
-		  pthread_mutex_unlock(&samples_wait_process_mutex[sample_num]);
-		  samples_wait_process[sample_num] = 0;
-		}
-	      
-	      /* read ONE frame from our soundfile (4kb assumedly),
-		 sometimes it's good to be a slowpoke! */
-	      read_frames = sf_readf_float (info[sample_num].sndfile, buf_out, 1);
-	      
-	      /*
-		NORMAL PLAYBACK OR FASTER
-	      */
-	      /* if this sample's playback is NOT reversed.. */
-	      if(!info[sample_num].reverse)
-		{
-		  /* if this sample's speed multiplier is greater than 1 */
-		  if(info[sample_num].speedmult>1)
-		    {
-		      /* advance frame position by the speed multiplier */
-		      info[sample_num].pos+=(int)(info[sample_num].speedmult);
-		      
-		      /* account for tenths and hundreths resolution of GREATER speed multiple */
-		      if(random_in_range(0,99)<((int)((info[sample_num].speedmult-(int)(info[sample_num].speedmult))*100)))
-			info[sample_num].pos++;
-		    }
-		}
-	      /* if playback is reversed.. */
-	      else
-		{
-		  /* if speed multiplier is greater than 1 */
-		  if(info[sample_num].speedmult>1)
-		    {
-		      /* if we're about to fall off the edge of out sample */
-		      if( (int)(info[sample_num].pos-info[sample_num].speedmult-1)<0)
-			/* reset frames to end of file */
-			info[sample_num].pos=sndfileinfo[sample_num].frames-1;
-		      else
-			/* otherwise rewind our position in the soundfile */
-			info[sample_num].pos-=(int)info[sample_num].speedmult;
-		      
-		      /* account for tenths and hundreths resolution of GREATER speed multiple */
-		      if(random_in_range(0,99)<((int)((info[sample_num].speedmult-(int)(info[sample_num].speedmult))*100)))
-			{
-			  if( (int)(info[sample_num].pos-1)<0)
-			    info[sample_num].pos=sndfileinfo[sample_num].frames-1;
-			  else
-			    info[sample_num].pos-=1;
-			}
-		    }
-		}
-	      
-	      if(info[sample_num].speedmult<=1)
-		{
-		  if(info[sample_num].reverse)
-		    {
-		      if((int)(info[sample_num].pos-1)<0)
-			{
-			  info[sample_num].pos=sndfileinfo[sample_num].frames-1;
-			}
-		      else
-			info[sample_num].pos-=1;
-		    }
-		  else
-		    info[sample_num].pos++;
-		}
-	      
-	      /* finally, seek to new position in the soundfile */
-	      sf_seek(info[sample_num].sndfile,info[sample_num].pos,SEEK_SET);
-	      
-	      /* if no frames read, we assume the end of file.. */
-	      if (read_frames == 0)
-		if(!info[sample_num].user_interrupt)
-		  break ;
-	      
-	      /* fill playback queue with data  */
-	      for (count = 0; count < read_frames; count++)
-		{
-		  /*
-		    AMPLITUDE RAMPING
-		  */
-		  /* if this sample has a ramp DOWN envelope.. */
-		  if( info[sample_num].rampup )
-		    {
-		      /* figure out the length of the ramp */
-		      ramplength=sndfileinfo[sample_num].frames * info[sample_num].rampup;
-		      rampstart=sndfileinfo[sample_num].frames-ramplength;
-		      /* if the ramp is still in progress, calculate new value of frame */
-		      if( info[sample_num].reverse==0 )
-			{
-			  if( info[sample_num].pos<ramplength )
-			    {
-			      /* calculate new value of frame */
-			      volume_factor=info[sample_num].pos/ramplength;
-			      buf_out[count]*=volume_factor;
-			    }
-			}
-		      else
-			if( info[sample_num].pos>rampstart )
-			  {
-			    /* calculate new value of frame */
-			    volume_factor=(sndfileinfo[sample_num].frames-info[sample_num].pos)/ramplength;
-			    buf_out[count]*=volume_factor;
-			  }
-		    }
-		  
-		  /* if this sample has a ramp UP envelope.. */
-		  if( info[sample_num].rampdown )
-		    {
-		      /* figure out length and start of this envelope */
-		      ramplength=sndfileinfo[sample_num].frames * info[sample_num].rampdown;
-		      rampstart=sndfileinfo[sample_num].frames-ramplength;
-		      /* if this ramp has started.. */
-		      if( info[sample_num].reverse==0 )
-			{
-			  if( info[sample_num].pos>rampstart )
-			    {
-			      /* calculate new value of frame */
-			      volume_factor=(sndfileinfo[sample_num].frames-info[sample_num].pos)/ramplength;
-			      buf_out[count]*=volume_factor;
-			    }
-			}
-		      else
-			if( info[sample_num].pos<ramplength )
-			  { 
-			    volume_factor=info[sample_num].pos/ramplength;
-			    buf_out[count]*=volume_factor;
-			  }
-		    }
-		  
-		  /*
-		    SLOW OR NORMAL PLAYBACK
-		  */
-		  /* if speed multiplier is less than 1.0.. */
-		  if(info[sample_num].speedmult<1)
-		    {
-		      /* coarse calculation of frames to duplicate */
-		      slow_speedmult=(1-info[sample_num].speedmult)*4;
-		      if(slow_speedmult>1)
-			for(count1=0; count1<(int)slow_speedmult;count1++)
-			  rtqueue_enq(fifo_out[info[sample_num].bank_number],buf_out[count]);
-		      else
-			rtqueue_enq(fifo_out[info[sample_num].bank_number],buf_out[count]);
-		      /* fine calculation of frames to duplicate */
-		      if( slow_speedmult-(int)slow_speedmult>0)
-			if(random_in_range(0,99)<(1-info[sample_num].speedmult)*100)
-			  rtqueue_enq(fifo_out[info[sample_num].bank_number],buf_out[count]);
-		    }
-		  else
-		    /* otherwise, queue a sample like normal */
-		    rtqueue_enq(fifo_out[info[sample_num].bank_number], buf_out[count]);
-		}
-	      /* signal process thread there is data to process 
-		 from this sample bank */
-	      samples_can_process[info[sample_num].bank_number] = 1 ;
-	    }
-	  
-	  if( info[sample_num].kill )
-	    break;
+      work = atomic_load(&stream_work);
 
-	  /* hang here until this sample has finished playing */
-	  if( samples_can_process[sample_num] )
-	    {
-	      /* if the sample retriggers or something like that, we'll get a signal from functions
-		 ficus_playback() and ficus_killplayback() to resume thread execution */
-	      
-	      samples_finished_playing[sample_num] = 1;
-	      
-	      pthread_mutex_lock(&samples_finished_playing_mutex[sample_num]);
-	      pthread_cond_wait(&samples_finished_playing_cond[sample_num], &samples_finished_playing_mutex[sample_num]);
-	      pthread_mutex_unlock(&samples_finished_playing_mutex[sample_num]);
-	      
-	      samples_finished_playing[sample_num] = 0;
-	    } 
-	  if( info[sample_num].kill )
-	    {
-	      break;
-	    }
+      bank = stream_pick();
+      if( bank >= 0 )
+	{
+	  stream_service(bank, buf);
+	  atomic_store(&stream_info[bank].claimed, 0);
+	  continue;
 	}
-      while( (loop_state[info[sample_num].bank_number]==1) );
-      
-      if( info[sample_num].kill )
+
+      stream_release_idle();
+
+      /* nothing to do, sleep until process() or ficus_playback()
+	 has work for us. process() can't block on our mutex so
+	 its wake up might be missed, never sleep for long */
+      pthread_mutex_lock(&stream_wait_mutex);
+      if( stream_workers_run && (work == atomic_load(&stream_work)) )
 	{
-	  info[sample_num].kill = 0;
-	  break;
+	  clock_gettime(CLOCK_REALTIME, &timeout);
+	  timeout.tv_nsec += 5000000;
+	  if( timeout.tv_nsec >= 1000000000 )
+	    {
+	      timeout.tv_sec++;
+	      timeout.tv_nsec -= 1000000000;
+	    }
+	  pthread_cond_timedwait(&stream_wait_cond, &stream_wait_mutex, &timeout);
 	}
+      pthread_mutex_unlock(&stream_wait_mutex);
     }
-  while( info[sample_num].user_interrupt);
-  
-  /* done with this sample bank! */
-  active_file_record[0][sample_num] = 0;
   
   return 0 ;
-} /* disk_thread */
+} /* stream_worker */
+
+void
+stream_wake ()
+{
+  /* hand the pool new work, from outside process() */
+  pthread_mutex_lock(&stream_wait_mutex);
+  atomic_fetch_add(&stream_work, 1);
+  pthread_cond_broadcast(&stream_wait_cond);
+  pthread_mutex_unlock(&stream_wait_mutex);
+} /* stream_wake */
 
 int
 init_recbank (thread_info_in_t *info, int banknumber, int bit_depth, char *path)
@@ -613,6 +2221,10 @@ init_recbank (thread_info_in_t *info, int banknumber, int bit_depth, char *path)
   int short_mask;
 
   info->path = path;
+  info->tmp_path = (char *) malloc (strlen(path) + 5);
+  if( info->tmp_path == NULL )
+    return 1;
+  sprintf(info->tmp_path, "%s.tmp", path);
 
   info->channels = 1;
   info->can_process = 0;
@@ -642,7 +2254,7 @@ init_recbank (thread_info_in_t *info, int banknumber, int bit_depth, char *path)
 
   sndfile_info.format = SF_FORMAT_WAV|short_mask;
   sndfile_info.channels = info->channels;
-  sndfile_info.samplerate = jack_get_sample_rate (client);
+  sndfile_info.samplerate = jack_sr;
 
   sndfileinfo_in[banknumber] = sndfile_info;
 
@@ -661,6 +2273,8 @@ char
   /* Transform constant array to non-constant array */
   len = strlen(full_path) + 1;
   return_path = malloc(len);
+  if( return_path == NULL )
+    return NULL;
 
   /* We can only do this because full_path is already null-terminated */
   strcpy(return_path, full_path);
@@ -675,12 +2289,17 @@ setup_recbanks(char *path, char *prefix, int bit_depth)
   char *filepath;
   
   /* Build filename and setup the soundfile for capturing */
-  for (c=0; c < NUM_SAMPLES; c++)
+  for (c=0; c < num_banks; c++)
     {
       filepath = build_path(path, prefix, c);
-      init_recbank(&info_in[c], c, bit_depth, filepath);
+      if( filepath == NULL )
+	return 1;
+      if( init_recbank(&info_in[c], c, bit_depth, filepath) == 1 )
+	{
+	  free (filepath) ;
+	  return 1;
+	}
     }
-  free(filepath);
 
   return 0;
 } /* setup_recbanks */
@@ -688,10 +2307,13 @@ setup_recbanks(char *path, char *prefix, int bit_depth)
 int
 ficus_capture ( int banknumber, int seconds)
 {
+  if( (banknumber < 0) || (banknumber >= num_banks) )
+    return 1;
+
   info_in[banknumber].duration = seconds;
 
   /* Try to create a soundfile for opening */
-  if ((info_in[banknumber].sndfile = sf_open (info_in[banknumber].path, SFM_WRITE, &sndfileinfo_in[banknumber])) == NULL)
+  if ((info_in[banknumber].sndfile = sf_open (info_in[banknumber].tmp_path, SFM_WRITE, &sndfileinfo_in[banknumber])) == NULL)
     {
       char errstr[256];
       sf_error_str (0, errstr, sizeof (errstr) - 1);
@@ -708,9 +2330,13 @@ ficus_capture ( int banknumber, int seconds)
     info_in[banknumber].duration *= jack_sr;
 
   info_in[banknumber].kill = 0;
+  info_in[banknumber].status = 0;
+  info_in[banknumber].total_captured = 0;
+  info_in[banknumber].overruns_armed = overruns;
+  info_in[banknumber].keep_ram = preload_mode[banknumber] != FICUS_PRELOAD_OFF;
   info_in[banknumber].can_capture = 1;
 
-  pthread_cond_signal(&capture_thread_wait_cond);
+  capture_wake();
 
   return 0;
 } /* ficus_capture */
@@ -718,10 +2344,13 @@ ficus_capture ( int banknumber, int seconds)
 int
 ficus_capturef(int banknumber, int captureframes)
 {
+  if( (banknumber < 0) || (banknumber >= num_banks) )
+    return 1;
+
   info_in[banknumber].duration = captureframes;
 
   /* Try to create a soundfile for opening */
-  if ((info_in[banknumber].sndfile = sf_open (info_in[banknumber].path, SFM_WRITE, &sndfileinfo_in[banknumber])) == NULL)
+  if ((info_in[banknumber].sndfile = sf_open (info_in[banknumber].tmp_path, SFM_WRITE, &sndfileinfo_in[banknumber])) == NULL)
     {
       char errstr[256];
       sf_error_str (0, errstr, sizeof (errstr) - 1);
@@ -737,130 +2366,706 @@ ficus_capturef(int banknumber, int captureframes)
   else
     info_in[banknumber].duration = captureframes;
 
-  info_in[banknumber].can_capture = 1;
   info_in[banknumber].kill = 0;
+  info_in[banknumber].status = 0;
+  info_in[banknumber].total_captured = 0;
+  info_in[banknumber].overruns_armed = overruns;
+  info_in[banknumber].keep_ram = preload_mode[banknumber] != FICUS_PRELOAD_OFF;
+  info_in[banknumber].can_capture = 1;
 
-  pthread_cond_signal(&capture_thread_wait_cond);
+  capture_wake();
 
   return 0;
 } /* ficus_capture */
 
 int
-ficus_durationf_out( int bank_number )
+ficus_durationf_out( int bank_number )
+{
+  int duration=0;
+  /* return the duration of sndfile in frames */
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 0;
+
+  duration=sndfileinfo[bank_number].frames;
+  return duration;
+} /* ficus_durationf */
+
+int
+ficus_durationf_in( int bank_number )
+{
+  int duration=0;
+  /* return the duration of sndfile in frames */
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 0;
+
+  duration=sndfileinfo_in[bank_number].frames;
+  return duration;
+} /* ficus_durationf */
+
+int
+command_post(int type, int bank_number, int arg, float value)
+{
+  /* hand a ficus_* mutator to process(), which applies it at
+     the start of its next period in the order it was posted.
+     if the ring is full we wait for process() to catch up, 
+     for a second at most in case JACK isn't running us */
+  event_t event;
+  int tries = 0;
+
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 1;
+
+  event.frame = frame_time();
+  event.type = type;
+  event.bank = bank_number;
+  event.arg = arg;
+  event.value = value;
+
+  while( evqueue_push(events, &event) )
+    if( tries++ == 1000 )
+      {
+	fprintf(stderr, "ficus: command ring full, dropped a command for bank %d\n", bank_number);
+	return 1;
+      }
+    else
+      usleep(1000);
+
+  return 0;
+} /* command_post */
+
+void
+ficus_playback_speed(int bank_number, float speed)
+{
+  /* speed - negative plays in reverse */
+  command_post(FICUS_EVENT_SPEED, bank_number, 0, speed);
+} /* ficus_playback_reverse */
+
+int
+ficus_playback_quality(int bank_number, int quality)
+{
+  /* quality - how playback at speeds other than 1 fills in
+     between frames, FICUS_RESAMPLE_LINEAR is cheapest,
+     FICUS_RESAMPLE_SINC sounds best */
+  if( (quality < FICUS_RESAMPLE_LINEAR) || (quality > FICUS_RESAMPLE_SINC) )
+    return 1;
+
+  return command_post(FICUS_EVENT_QUALITY, bank_number, quality, 0);
+} /* ficus_playback_quality */
+
+int
+ficus_polyphony(int bank_number, int voices)
+{
+  /* voices - how many triggers of a preloaded bank may play
+     over each other, 1 cuts the last one off like always.
+     the extra voices come from a pool all banks share */
+  if( voices < 1 )
+    return 1;
+
+  return command_post(FICUS_EVENT_POLYPHONY, bank_number, voices, 0);
+} /* ficus_polyphony */
+
+int
+ficus_voice_pool(int voices)
+{
+  /* voices - how many voices polyphonic banks share. only has
+     an effect before ficus_setup() */
+  if( (voice_pool != NULL) || (voices < 0) )
+    return 1;
+
+  voice_pool_size = voices;
+
+  return 0;
+} /* ficus_voice_pool */
+
+void
+ficus_playback(int bank_number)
+{
+
+  /* (re)start this bank on process()' next period. it counts
+     as playing from now on */
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return;
+
+  if( atomic_load(&latency_probe[bank_number].state) == PROBE_INGRESS )
+    {
+      latency_probe[bank_number].hop[FICUS_LATENCY_DISPATCH] = latency_clock();
+      atomic_store_explicit(&latency_probe[bank_number].state, PROBE_DISPATCHED,
+			    memory_order_release);
+    }
+  atomic_fetch_add(&info[bank_number].triggers_posted, 1);
+  if( command_post(FICUS_EVENT_TRIGGER, bank_number, 1, 0) )
+    atomic_fetch_sub(&info[bank_number].triggers_posted, 1);
+} /* ficus_playback */
+
+void 
+ficus_playback_rampup(int bank_number, float rampduration)
+{
+  command_post(FICUS_EVENT_RAMPUP, bank_number, 0, rampduration);
+} /* ficus_playback_rampup */
+
+void 
+ficus_playback_rampdown(int bank_number, float rampduration)
+{
+  command_post(FICUS_EVENT_RAMPDOWN, bank_number, 0, rampduration);
+} /* ficus_playback_rampdown */
+
+void
+wait_process_cycles()
+{
+  /* wait for process() to run through a couple of periods so
+     it is no longer touching memory we're about to release.
+     JACK shutting down ends the program, so the only time
+     process() doesn't come round is after ficus_clean() */
+  unsigned long start = process_cycles;
+
+  /* offline, process() only runs while ficus_render() holds
+     render_mutex, it's done with memory once we get it */
+  if( render_offline )
+    {
+      pthread_mutex_lock(&render_mutex);
+      pthread_mutex_unlock(&render_mutex);
+      return;
+    }
+
+  while( (process_cycles - start < 2) && !process_stopped )
+    usleep(1000);
+} /* wait_process_cycles */
+
+int
+preload_reserve(int bank_number, sf_count_t frames, sf_count_t held)
+{
+  /* charge the budget for a bank growing to 'frames' frames in
+     memory, of which it holds 'held' already. checking and
+     charging in one step keeps captures and loads that run at
+     the same time from overrunning the budget together.
+     returns 1 if the bank may not keep that many */
+  long more = (frames - held) * sample_size;
+  int fits = 1;
+
+  if( frames <= 0 )
+    return 1;
+
+  switch( preload_mode[bank_number] )
+    {
+    case FICUS_PRELOAD_OFF:
+      return 1;
+    case FICUS_PRELOAD_AUTO:
+      if( frames > PRELOAD_FRAMES )
+	return 1;
+      break;
+    }
+
+  pthread_mutex_lock(&preload_mutex);
+  if( preload_used + more <= preload_budget )
+    preload_used += more;
+  else
+    fits = 0;
+  pthread_mutex_unlock(&preload_mutex);
+
+  return !fits;
+} /* preload_reserve */
+
+void
+preload_unreserve(sf_count_t frames)
+{
+  /* give 'frames' frames of memory back to the budget */
+  pthread_mutex_lock(&preload_mutex);
+  preload_used -= frames * sample_size;
+  pthread_mutex_unlock(&preload_mutex);
+} /* preload_unreserve */
+
+float *
+decode_frames(stream_info_t *st, sf_count_t frames)
+{
+  /* the first 'frames' frames of a soundfile, first channel
+     only, in a 64-byte aligned buffer of their own. returns
+     NULL if they can't be read */
+  float *ram;
+  sf_count_t pos, i;
+
+  if( posix_memalign((void **) &ram, 64, frames * sample_size) )
+    return NULL;
+
+  if( st->wavmap )
+    {
+      if( wavmap_read(st->wavmap, 0, ram, frames) == frames )
+	return ram;
+      free(ram);
+      return NULL;
+    }
+
+  for( pos = 0; pos < frames; pos += st->stream_count )
+    {
+      if( stream_fill_at(st, pos) )
+	{
+	  free(ram);
+	  return NULL;
+	}
+      for( i = 0; (i < st->stream_count) && (pos + i < frames); i++ )
+	ram[pos + i] = st->stream_buf[i * st->channels];
+    }
+
+  return ram;
+} /* decode_frames */
+
+float *
+head_load(stream_info_t *st, sf_count_t frames, sf_count_t *head_frames)
+{
+  /* the head of a streamed soundfile 'frames' frames long, no
+     more of it than head_ms milliseconds' worth, for triggers
+     to play from memory. NULL if there's none */
+  float *head;
+
+  *head_frames = (sf_count_t) head_ms * jack_sr / 1000;
+  if( *head_frames > frames )
+    *head_frames = frames;
+  if( (*head_frames <= 0) ||
+      ((head = decode_frames(st, *head_frames)) == NULL) )
+    {
+      *head_frames = 0;
+      return NULL;
+    }
+
+  return head;
+} /* head_load */
+
+float *
+preload_file(int bank_number, stream_info_t *st, sf_count_t frames)
+{
+  /* decode a whole soundfile into a 64-byte aligned buffer
+     (first channel only, like it streams from disk) so
+     process() can play it without touching the disk. NULL
+     if it doesn't fit the bank's preload budget */
+  float *ram;
+
+  if( preload_reserve(bank_number, frames, 0) )
+    return NULL;
+
+  if( (ram = decode_frames(st, frames)) == NULL )
+    preload_unreserve(frames);
+
+  return ram;
+} /* preload_file */
+
+int
+stream_open(stream_info_t *st, char *path, SF_INFO *sfinfo)
+{
+  /* get a soundfile libsndfile has opened as st->sndfile ready
+     for streaming. returns 1 if there's no memory for it */
+  st->channels = sfinfo->channels ;
+  st->stream_buf = (float *) malloc (sample_size * STREAM_FRAMES * st->channels) ;
+  if( st->stream_buf == NULL )
+    return 1;
+
+  /* plain WAV files are read straight from a mapping of the
+     file, libsndfile reads the rest.  it has to agree with
+     libsndfile about what's in there */
+  st->wavmap = wavmap_open (path) ;
+  if( st->wavmap &&
+      ((st->wavmap->frames != sfinfo->frames) ||
+       (st->wavmap->channels != sfinfo->channels)) )
+    {
+      wavmap_close (st->wavmap) ;
+      st->wavmap = NULL;
+    }
+
+  /* libsndfile's reads can't be told what's coming, a file
+     of our own can, see stream_prefetch() */
+  if( st->wavmap == NULL )
+    st->hint_fd = open (path, O_RDONLY) ;
+  if( st->hint_fd >= 0 )
+    st->hint_size = lseek (st->hint_fd, 0, SEEK_END) ;
+
+  return 0;
+} /* stream_open */
+
+void
+stream_close(stream_info_t *st)
+{
+  /* let go of everything a bank streams its soundfile with */
+  if( st->sndfile != NULL )
+    sf_close (st->sndfile) ;
+  free (st->stream_buf) ;
+  free (st->fade_buf) ;
+  wavmap_close (st->wavmap) ;
+  if( st->hint_fd >= 0 )
+    close (st->hint_fd) ;
+} /* stream_close */
+
+void
+load_wait(int bank_number, int seq)
+{
+  /* wait for process() to carry out swap number 'seq'.
+     offline, the thread waiting may well be the one that
+     renders, so the events due now are applied right here.
+     once process() has stopped for good nothing reads the
+     bank, we swap it ourselves */
+  bank_load_t *ld = &bank_load[bank_number];
+
+  if( render_offline )
+    events_flush();
+
+  while( (atomic_load_explicit(&ld->done, memory_order_acquire) != seq) &&
+	 !process_stopped )
+    usleep(1000);
+
+  if( atomic_load(&ld->done) != seq )
+    {
+      load_swap(bank_number);
+      atomic_store(&ld->done, seq);
+    }
+} /* load_wait */
+
+int
+load_bank_locked(char *path, int bank_number, float *ram, sf_count_t ram_frames)
+{
+  /* point a bank at a soundfile. 'ram' optionally holds all
+     of it already, charged to the preload budget, the bank
+     takes it over and plays from it. the new soundfile is
+     opened and decoded here, then process() swaps it in and
+     stops the bank. the old one is only freed once process()
+     says it's done with it. if the soundfile can't be opened
+     the memory is freed and the bank is left empty */
+  bank_load_t *ld = &bank_load[bank_number];
+  stream_info_t next, *st = &stream_info[bank_number];
+  SF_INFO sfinfo;
+  float *head = NULL;
+  sf_count_t head_frames = 0;
+  int failed = 0, seq;
+
+  /* Open the soundfile. */
+  memset (&next, 0, sizeof (next)) ;
+  next.hint_fd = -1;
+  memset (&sfinfo, 0, sizeof (sfinfo)) ;
+  next.sndfile = sf_open (path, SFM_READ, &sfinfo) ;
+
+  /* Try to see if sf_open() was successful, otherwise leave
+     the bank empty, with no frames to play */
+  if( (next.sndfile == NULL) || stream_open(&next, path, &sfinfo) )
+    {
+      stream_close(&next);
+      memset (&next, 0, sizeof (next)) ;
+      next.hint_fd = -1;
+      memset (&sfinfo, 0, sizeof (sfinfo)) ;
+      if( ram != NULL )
+	preload_unreserve(ram_frames);
+      free(ram);
+      ram = NULL;
+      ram_frames = 0;
+      failed = 1;
+    }
+  /* captured audio is in memory already. keep short soundfiles
+     in memory if there's room, and the head of the others */
+  else if( ram == NULL )
+    {
+      if( (ram = preload_file(bank_number, &next, sfinfo.frames)) != NULL )
+	ram_frames = sfinfo.frames;
+      else
+	head = head_load(&next, sfinfo.frames, &head_frames);
+    }
+
+  /* no worker streams from the bank while it changes hands */
+  while( atomic_exchange(&st->claimed, 1) )
+    usleep(1000);
+
+  ld->sfinfo = sfinfo;
+  ld->ram = ram;
+  ld->ram_frames = ram_frames;
+  ld->head = head;
+  ld->head_frames = head_frames;
+  seq = atomic_load(&ld->done) + 1;
+  if( command_post(EVENT_LOAD, bank_number, seq, 0) )
+    {
+      /* the bank keeps the soundfile it had */
+      atomic_store(&st->claimed, 0);
+      stream_close(&next);
+      if( ram != NULL )
+	preload_unreserve(ram_frames);
+      free(ram);
+      free(head);
+      return 1;
+    }
+  load_wait(bank_number, seq);
+
+  /* process() is done with the old soundfile, and so are the
+     workers. the new one streams from where process() swapped
+     it in */
+  stream_close(st);
+  next.generation_seen = ld->generation;
+  atomic_store(&next.claimed, 1);
+  *st = next;
+  sndfile[bank_number] = st->sndfile;
+  if( ld->ram != NULL )
+    preload_unreserve(ld->ram_frames);
+  free(ld->ram);
+  free(ld->head);
+  ld->ram = NULL;
+  ld->head = NULL;
+  atomic_store(&st->claimed, 0);
+
+  return failed;
+} /* load_bank_locked */
+
+int
+load_bank(char *path, int bank_number, float *ram, sf_count_t ram_frames)
+{
+  /* load_bank_locked(), one load of a bank at a time */
+  int failed;
+
+  pthread_mutex_lock(&load_mutex[bank_number]);
+  failed = load_bank_locked(path, bank_number, ram, ram_frames);
+  pthread_mutex_unlock(&load_mutex[bank_number]);
+
+  return failed;
+} /* load_bank */
+
+int
+ficus_loadfile(char *path, int bank_number)
+{
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 1;
+
+  return load_bank(path, bank_number, NULL, 0);
+} /* ficus_loadfile */
+
+int
+ficus_preload(int bank_number, int mode)
+{
+  /* mode - FICUS_PRELOAD_AUTO keeps the soundfile in memory if
+     it's short enough, FICUS_PRELOAD_ON whenever it fits the
+     budget, FICUS_PRELOAD_OFF always streams it from disk.
+     takes effect the next time a file is loaded to this bank */
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 1;
+
+  preload_mode[bank_number] = mode;
+
+  return 0;
+} /* ficus_preload */
+
+int
+ficus_stream_workers(int workers)
+{
+  /* workers - size of the disk streaming pool, 0 runs one
+     thread per core. only has an effect before ficus_setup() */
+  if( stream_worker_id != NULL )
+    return 1;
+
+  stream_workers = workers;
+
+  return 0;
+} /* ficus_stream_workers */
+
+int
+ficus_head_cache(int ms)
+{
+  /* ms - how much of every streamed soundfile is kept in
+     memory so a trigger can play it while the disk catches
+     up, 0 keeps none. takes effect the next time a file is
+     loaded */
+  if( ms < 0 )
+    return 1;
+
+  head_ms = ms;
+
+  return 0;
+} /* ficus_head_cache */
+
+int
+ficus_prefetch(int frames)
+{
+  /* frames - how far ahead of every streaming bank the kernel
+     reads in the background, 0 turns it off */
+  if( frames < 0 )
+    return 1;
+
+  prefetch_frames = frames;
+
+  return 0;
+} /* ficus_prefetch */
+
+int
+ficus_preload_budget(long bytes)
+{
+  /* bytes - memory all preloaded soundfiles may use together */
+  preload_budget = bytes;
+
+  return 0;
+} /* ficus_preload_budget */
+
+int
+ficus_queue_pool(long bytes)
+{
+  /* bytes - queue memory streaming banks and captures borrow
+     from. only has an effect before ficus_setup() */
+  if( queue_pool != NULL )
+    return 1;
+
+  queue_pool_bytes = bytes;
+
+  return 0;
+} /* ficus_queue_pool */
+
+long
+ficus_queue_pool_available()
+{
+  /* bytes of queue memory nobody's borrowed */
+  if( queue_pool == NULL )
+    return 0;
+
+  return (long) rtqueue_pool_available(queue_pool) * QUEUE_CHUNK * sample_size;
+} /* ficus_queue_pool_available */
+
+unsigned int
+ficus_frame_time()
+{
+  /* JACK's frame time, roughly now. when rendering offline
+     it's the first frame the next ficus_render() renders */
+  return frame_time();
+} /* ficus_frame_time */
+
+int
+ficus_schedule(unsigned int frame, int type, int bank_number, int arg, float value)
 {
-  int duration=0;
-  /* return the duration of sndfile in frames */
-  duration=sndfileinfo[bank_number].frames;
-  return duration;
-} /* ficus_durationf */
+  /* have process() carry out an event on the exact frame
+     'frame' of JACK's frame time, or during the next period
+     if that's already passed.  type is a FICUS_EVENT_*, arg
+     the channel for FICUS_EVENT_MIXOUT/MIXIN, the quality
+     for FICUS_EVENT_QUALITY, the voices for
+     FICUS_EVENT_POLYPHONY or the frame or length for
+     FICUS_EVENT_LOOP_START/END/FADE, value the speed, ramp,
+     routing or loop state. safe to call from any thread, returns 1
+     if too many events are waiting */
+  event_t event;
+
+  if( (bank_number < 0) || (bank_number >= num_banks) ||
+      (type < FICUS_EVENT_TRIGGER) || (type > FICUS_EVENT_LOOP_FADE) ||
+      ((type == FICUS_EVENT_POLYPHONY) && (arg < 1)) ||
+      (((type == FICUS_EVENT_LOOP_START) || (type == FICUS_EVENT_LOOP_END)) &&
+       (arg < 0)) ||
+      ((type == FICUS_EVENT_LOOP_FADE) && ((arg < 0) || (arg > LOOP_FADE_MAX))) ||
+      (((type == FICUS_EVENT_MIXOUT) || (type == FICUS_EVENT_MIXIN)) &&
+       ((arg < 0) || (arg >= num_channels))) ||
+      ((type == FICUS_EVENT_QUALITY) &&
+       ((arg < FICUS_RESAMPLE_LINEAR) || (arg > FICUS_RESAMPLE_SINC))) )
+    return 1;
 
-int
-ficus_durationf_in( int bank_number )
+  event.frame = frame;
+  event.type = type;
+  event.bank = bank_number;
+  event.arg = type == FICUS_EVENT_TRIGGER ? 0 : arg;
+  event.value = value;
+
+  return evqueue_push(events, &event);
+} /* ficus_schedule */
+
+unsigned int
+ficus_transport_start(double bpm)
 {
-  int duration=0;
-  /* return the duration of sndfile in frames */
-  duration=sndfileinfo_in[bank_number].frames;
-  return duration;
-} /* ficus_durationf */
+  /* start counting off steps, 'bpm' of them a minute. returns
+     the frame the first step lands on, a couple of periods
+     from now so there's time to ficus_schedule() it */
+  atomic_store(&transport_state, TRANSPORT_STOPPED);
+  wait_process_cycles();
+
+  transport_bpm = bpm > 0 ? bpm : 120.0;
+  transport_start = frame_time() + TRANSPORT_LEAD * period_size();
+  transport_seen = 0;
+  atomic_store(&transport_position, transport_start);
+  while( sem_trywait(&transport_sem) == 0 );
+  atomic_store_explicit(&transport_state, TRANSPORT_STARTING, memory_order_release);
+
+  return transport_start;
+} /* ficus_transport_start */
 
 void
-ficus_playback_speed(int bank_number, float speed)
+ficus_transport_stop()
 {
-  if(speed<0)
-    {
-      info[bank_number].reverse=1;
-      info[bank_number].speedmult=speed*(-1);
-    }
-  else
-    {
-      info[bank_number].speedmult=speed;
-      info[bank_number].reverse=0;
-    }
-} /* ficus_playback_reverse */
+  atomic_store(&transport_state, TRANSPORT_STOPPED);
+  sem_post(&transport_sem);
+} /* ficus_transport_stop */
 
 void
-ficus_playback(int bank_number)
+ficus_transport_tempo(double bpm)
 {
+  /* takes effect from the next step on */
+  if( bpm > 0 )
+    transport_bpm = bpm;
+} /* ficus_transport_tempo */
 
-  /* if a 'play' sample thread is already rolling, seek back the file */
-  if(active_file_record[0][bank_number])
+int
+ficus_transport_wait(unsigned int *next_frame)
+{
+  /* sleep until the transport passes a step, or 50ms at most.
+     returns how many steps went by since the last call and
+     sets 'next_frame' to the frame the next one lands on.
+     only one thread may wait on the transport. offline it
+     doesn't sleep, the steps only pass while ficus_render()
+     runs */
+  struct timespec timeout;
+  unsigned long long position;
+  unsigned int passed;
+
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_nsec += 50000000;
+  if( timeout.tv_nsec >= 1000000000 )
     {
-      info[bank_number].user_interrupt = 1 ;
+      timeout.tv_sec++;
+      timeout.tv_nsec -= 1000000000;
+    }
+  if( !render_offline )
+    sem_timedwait(&transport_sem, &timeout);
+  while( sem_trywait(&transport_sem) == 0 );
 
-      interrupt_clear_fifo_out(bank_number);
+  position = atomic_load(&transport_position);
+  passed = (unsigned int) (position >> 32) - transport_seen;
+  transport_seen += passed;
+  *next_frame = (unsigned int) position;
 
-      if( samples_finished_playing[bank_number] )
-	pthread_cond_signal(&samples_finished_playing_cond[bank_number]);
+  return passed;
+} /* ficus_transport_wait */
 
-      if( samples_wait_process[bank_number] )
-	pthread_cond_signal(&samples_wait_process_cond[bank_number]);
+int
+ficus_transport_sync(int mode)
+{
+  /* mode - FICUS_SYNC_INTERNAL counts steps off our own clock,
+     FICUS_SYNC_FOLLOW steps on the beats of JACK's transport, 
+     FICUS_SYNC_MASTER does the same but also makes us JACK's 
+     timebase master, publishing ficus_transport_tempo()'s bpm.
+     returns 1 if another client already is the master, or if
+     we're rendering offline and there's no JACK to sync to */
+  if( (mode < FICUS_SYNC_INTERNAL) || (mode > FICUS_SYNC_MASTER) ||
+      (render_offline && (mode != FICUS_SYNC_INTERNAL)) )
+    return 1;
 
-      if(info[bank_number].reverse)
-	{
-	  info[bank_number].pos=sndfileinfo[bank_number].frames-1;
-	  sf_seek  (info[bank_number].sndfile, info[bank_number].pos, SEEK_SET) ;
-	}
-      else
-	{
-	  info[bank_number].pos=0;
-	  sf_seek  (info[bank_number].sndfile, 0, SEEK_SET) ;
-	}
-    }
-  else
+  if( mode == FICUS_SYNC_MASTER )
     {
-      
-      /* let the world know that we are currently
-	 processing this soundfile */
-      active_file_record[0][info[bank_number].bank_number] = 1;
-      interrupt_clear_fifo_out(bank_number);
-
-      /* if not, start the disk thread for this bank */
-      pthread_create (&info[bank_number].thread_id, NULL, disk_thread, bank_number);
-      info[bank_number].kill = 0;
-      pthread_detach(info[bank_number].thread_id);
+      timebase_valid = 0;
+      if( jack_set_timebase_callback(client, 1, transport_timebase, NULL) )
+	return 1;
     }
-} /* ficus_playback */
+  else if( transport_sync == FICUS_SYNC_MASTER )
+    jack_release_timebase(client);
 
-void 
-ficus_playback_rampup(int bank_number, float rampduration)
-{
-  info[bank_number].rampup=rampduration;
-} /* ficus_playback_rampup */
+  transport_sync = mode;
 
-void 
-ficus_playback_rampdown(int bank_number, float rampduration)
+  return 0;
+} /* ficus_transport_sync */
+
+int
+ficus_transport_isrolling()
 {
-  info[bank_number].rampdown=rampduration;
-} /* ficus_playback_rampdown */
+  return atomic_load(&transport_state) != TRANSPORT_STOPPED;
+} /* ficus_transport_isrolling */
 
 int
-ficus_loadfile(char *path, int bank_number)
+ficus_ispreloaded(int bank_number)
 {
-  /* Open the soundfile. */
-  sndfileinfo[bank_number].format = 0 ;
-  sndfile[bank_number] = sf_open (path, SFM_READ, &sndfileinfo[bank_number]) ;
-  
-  /* Try to see if sf_open() was successful, otherwise return */
-  if (sndfile[bank_number] == NULL)
-    {
-      return 1;
-    };
-
-  /* Init the thread info struct. */
-  memset (&info[bank_number], 0, sizeof (info[bank_number])) ; 
-  info[bank_number].read_done = 0 ;
-  info[bank_number].play_done = 0;
-  info[bank_number].sndfile = sndfile[bank_number] ;
-  info[bank_number].pos = 0 ;
-  info[bank_number].bank_number = bank_number;
-  info[bank_number].user_interrupt = 0;
-  info[bank_number].kill = 0;  
-  info[bank_number].reverse = 0;
-  info[bank_number].speedmult = 1.0;
-  info[bank_number].rampup = 0.0;
-  info[bank_number].rampdown = 0.0;
-  return 0;
-} /* ficus_loadfile */
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 0;
+
+  return info[bank_number].ram != NULL;
+} /* ficus_ispreloaded */
 
 int
 ficus_setmixin(int bank_number, int channel, int state)
@@ -869,9 +3074,10 @@ ficus_setmixin(int bank_number, int channel, int state)
   /* channel - channel */
   /* state - state of specified channel 1/on 0/off */
 
-  capture_mix[bank_number][channel] = state;
- 
-  return 0;
+  if( (channel < 0) || (channel >= num_channels) )
+    return 1;
+
+  return command_post(FICUS_EVENT_MIXIN, bank_number, channel, state == 1);
 } /* ficus_setmixin */
 
 int
@@ -881,49 +3087,98 @@ ficus_setmixout(int bank_number, int channel, int state)
   /* channel - channel */
   /* state - state of specified channel 1/on 0/off */
 
-  playback_mix[bank_number][channel] = state;
-  
-  return 0;
+  if( (channel < 0) || (channel >= num_channels) )
+    return 1;
+
+  return command_post(FICUS_EVENT_MIXOUT, bank_number, channel, state == 1);
 } /* ficus_setmixout */
 
 int
 ficus_loop(int bank_number, int state)
 {
  
-  loop_state[bank_number] = state;
-  
-  return 0;
+  return command_post(FICUS_EVENT_LOOP, bank_number, 0, state);
 } /* loop_bank */
 
+int
+ficus_loop_points(int bank_number, int start_frame, int end_frame)
+{
+  /* start_frame - first frame of the loop */
+  /* end_frame - frame after its last, 0 loops to the end of
+     the soundfile. the bank plays from its beginning as
+     always and repeats these frames once it reaches them */
+  if( (start_frame < 0) || (end_frame < 0) ||
+      (end_frame && (end_frame <= start_frame)) )
+    return 1;
+
+  return command_post(FICUS_EVENT_LOOP_START, bank_number, start_frame, 0) ||
+    command_post(FICUS_EVENT_LOOP_END, bank_number, end_frame, 0);
+} /* ficus_loop_points */
+
+int
+ficus_loop_fade(int bank_number, int frames)
+{
+  /* frames - how long the end of the loop crossfades into its
+     start, at equal power. 0 jumps straight back */
+  if( (frames < 0) || (frames > LOOP_FADE_MAX) )
+    return 1;
+
+  return command_post(FICUS_EVENT_LOOP_FADE, bank_number, frames, 0);
+} /* ficus_loop_fade */
+
 int
 ficus_iscapturing(int bank_number)
 {
-  return active_file_record[1][bank_number];
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 0;
+
+  return capture_record[bank_number];
 } /* ficus_iscapturing */
 
 
 int
 ficus_isplaying(int bank_number)
 {
-  return active_file_record[0][bank_number];
+  /* a bank is playing once ficus_playback() was called, even
+     if process() hasn't got to it yet */
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 0;
+
+  return info[bank_number].playing ||
+    (atomic_load(&info[bank_number].triggers_posted) > 0);
 } /* ficus_isplaying */
 
 int
 ficus_islooping(int bank_number)
 {
-  return loop_state[bank_number]; 
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 0;
+
+  return info[bank_number].loop; 
 } /* ficus_islooping */
 
+int
+ficus_numbanks()
+{
+  return num_banks;
+} /* ficus_numbanks */
+
+int
+ficus_numchannels()
+{
+  return num_channels;
+} /* ficus_numchannels */
+
 int
 ficus_killcapture (int bank_number)
 {
-  if( active_file_record[1] == 0 )
+  if( (bank_number < 0) || (bank_number >= num_banks) ||
+      (info_in[bank_number].can_capture == 0) )
     return 1;
   
-  if ( info_in[bank_number].duration != JACK_MAX_FRAMES )
-      info_in[bank_number].total_captured += info_in[bank_number].duration;
-  else
-    info_in[bank_number].kill = 1;
+  /* the capture thread closes the soundfile with whatever
+     it has written so far */
+  info_in[bank_number].kill = 1;
 
   return 0;
 } /* ficus_killcapture */
@@ -932,23 +3187,143 @@ ficus_killcapture (int bank_number)
 int
 ficus_killplayback (int bank_number)
 {
-  if( active_file_record[0][bank_number] == 0 )
+  if( (bank_number < 0) || (bank_number >= num_banks) ||
+      !ficus_isplaying(bank_number) )
     return 1;
 
-  active_file_record[0][bank_number] = 0;
+  /* Set this sample's playback to die. process() drops the
+     voice and the streaming pool stops reading for it */
+  return command_post(FICUS_EVENT_STOP, bank_number, 0, 0);
+} /* ficus_killplayback */
+
+int
+ficus_get_stats(ficus_stats_t *stats, int reset)
+{
+  /* a snapshot of how the engine has been doing. the
+     process() timings cover the periods since the last call
+     that passed 'reset', the counters everything since
+     ficus_setup() */
+  unsigned long count = atomic_load_explicit(&stats_ns_count, memory_order_relaxed);
+  double period_us = period_size() * 1e6 / jack_sr;
+
+  stats->periods = atomic_load_explicit(&stats_periods, memory_order_relaxed);
+  stats->dsp_min = atomic_load_explicit(&stats_ns_min, memory_order_relaxed) / 1000.0;
+  stats->dsp_max = atomic_load_explicit(&stats_ns_max, memory_order_relaxed) / 1000.0;
+  stats->dsp_avg = count ?
+    atomic_load_explicit(&stats_ns_sum, memory_order_relaxed) / 1000.0 / count : 0;
+  stats->dsp_load = stats->dsp_avg / period_us;
+  stats->dsp_peak = stats->dsp_max / period_us;
+  if( count == 0 )
+    stats->dsp_min = stats->dsp_max = stats->dsp_peak = 0;
+  stats->xruns = atomic_load_explicit(&stats_xruns, memory_order_relaxed);
+  stats->underruns = atomic_load_explicit(&stats_underruns, memory_order_relaxed);
+  stats->capture_drops = overruns;
+  stats->voices = active_count + pool_count;
+
+  if( reset )
+    atomic_store_explicit(&stats_reset, 1, memory_order_relaxed);
 
-  /* Set this sample's playback to die. */
-  info[bank_number].user_interrupt = 1;
-  info[bank_number].kill = 1;
+  return 0;
+} /* ficus_get_stats */
 
-  if( samples_finished_playing[bank_number] )
-    pthread_cond_signal(&samples_finished_playing_cond[bank_number]);
+int
+ficus_queue_fill(int bank_number)
+{
+  /* frames queued for a bank streaming from disk, 0 when it
+     plays from memory or isn't playing */
+  if( (bank_number < 0) || (bank_number >= num_banks) ||
+      !info[bank_number].streaming )
+    return 0;
+
+  return rtqueue_numrecords(fifo_out[bank_number]);
+} /* ficus_queue_fill */
+
+unsigned int
+ficus_underruns(int bank_number)
+{
+  /* blocks a streaming bank played short of audio because
+     the disk didn't keep up */
+  if( (bank_number < 0) || (bank_number >= num_banks) )
+    return 0;
+
+  return info[bank_number].underruns;
+} /* ficus_underruns */
+
+int
+ficus_latency(int state)
+{
+  /* state - 1 starts measuring trigger latency from scratch,
+     0 stops, the histograms stay as they are */
+  int path, hop, bucket;
+
+  if( state )
+    for( path = 0; path < FICUS_LATENCY_PATHS; path++ )
+      for( hop = 0; hop < FICUS_LATENCY_HOPS; hop++ )
+	for( bucket = 0; bucket < FICUS_LATENCY_BUCKETS; bucket++ )
+	  atomic_store(&latency_hist[path][hop][bucket], 0);
+  latency_enabled = state != 0;
 
-  if( samples_wait_process[bank_number] )
-    pthread_cond_signal(&samples_wait_process_cond[bank_number]);
-  
   return 0;
-} /* ficus_killplayback */
+} /* ficus_latency */
+
+unsigned long long
+ficus_latency_clock()
+{
+  /* nanoseconds, to stamp a trigger with when it comes in */
+  return latency_clock();
+} /* ficus_latency_clock */
+
+void
+ficus_latency_ingress(int bank_number, int path, unsigned long long ingress)
+{
+  /* the next ficus_playback() of this bank was asked for at
+     'ingress', by way of 'path', a FICUS_LATENCY_PATH_* */
+  latency_probe_t *probe;
+  int hop;
+
+  if( !latency_enabled || (bank_number < 0) || (bank_number >= num_banks) ||
+      (path < 0) || (path >= FICUS_LATENCY_PATHS) )
+    return;
+
+  probe = &latency_probe[bank_number];
+  atomic_store(&probe->state, PROBE_IDLE);
+  probe->path = path;
+  probe->ingress = ingress;
+  for( hop = 0; hop < FICUS_LATENCY_HOPS; hop++ )
+    probe->hop[hop] = 0;
+  atomic_store_explicit(&probe->state, PROBE_INGRESS, memory_order_release);
+} /* ficus_latency_ingress */
+
+unsigned long
+ficus_latency_histogram(int path, int hop, unsigned long *buckets)
+{
+  /* copy FICUS_LATENCY_BUCKETS counts of how long triggers
+     that came in on 'path' took from ingress to 'hop'. bucket
+     0 is under a microsecond, bucket b from 2^(b-1) up to 2^b
+     microseconds. returns how many triggers were counted */
+  unsigned long total = 0;
+  int bucket;
+
+  if( (path < 0) || (path >= FICUS_LATENCY_PATHS) ||
+      (hop < 0) || (hop >= FICUS_LATENCY_HOPS) )
+    return 0;
+
+  for( bucket = 0; bucket < FICUS_LATENCY_BUCKETS; bucket++ )
+    {
+      buckets[bucket] = atomic_load_explicit(&latency_hist[path][hop][bucket],
+					     memory_order_relaxed);
+      total += buckets[bucket];
+    }
+
+  return total;
+} /* ficus_latency_histogram */
+
+static int
+xrun_count (void *arg)
+{
+  atomic_fetch_add_explicit(&stats_xruns, 1, memory_order_relaxed);
+  return 0;
+} /* xrun_count */
 
 static void
 jack_shutdown (void *arg)
@@ -973,16 +3348,127 @@ jack_setup(char *client_name)
   return 0;
 } /* jack_setup */
 
+int
+bank_setup(int banks, int channels)
+{
+  /* size every per-bank and per-channel array. process() 
+     walks info[] so it gets cache line aligned memory */
+  int bank;
+
+  if( banks < 1 )
+    banks = NUM_SAMPLES;
+  if( channels < 1 )
+    channels = NUM_CHANNELS;
+  if( channels > MAX_CHANNELS )
+    {
+      fprintf (stderr, "ficus: at most %d channels\n", MAX_CHANNELS) ;
+      return 1;
+    }
+
+  num_banks = banks;
+  num_channels = channels;
+  voice_words = (banks + 63) / 64;
+
+  if( posix_memalign((void **) &info, 64, sizeof (thread_info_t) * banks) )
+    return 1;
+  memset(info, 0, sizeof (thread_info_t) * banks);
+
+  stream_info = calloc (banks, sizeof (stream_info_t)) ;
+  head_info = calloc (banks, sizeof (head_info_t)) ;
+  bank_load = calloc (banks, sizeof (bank_load_t)) ;
+  load_mutex = calloc (banks, sizeof (pthread_mutex_t)) ;
+  info_in = calloc (banks, sizeof (thread_info_in_t)) ;
+  sndfile = calloc (banks, sizeof (SNDFILE *)) ;
+  sndfile_in = calloc (banks, sizeof (SNDFILE *)) ;
+  sndfileinfo = calloc (banks, sizeof (SF_INFO)) ;
+  sndfileinfo_in = calloc (banks, sizeof (SF_INFO)) ;
+  capture_record = calloc (banks, sizeof (int)) ;
+  capture_mask = calloc (banks, sizeof (unsigned int)) ;
+  preload_mode = calloc (banks, sizeof (int)) ;
+  fifo_out = calloc (banks, sizeof (rtqueue_t *)) ;
+  fifo_in = calloc (channels, sizeof (rtqueue_t *)) ;
+  voice_pending = calloc (voice_words, sizeof (atomic_ullong)) ;
+  active_voices = calloc (banks, sizeof (int)) ;
+  voice_rs = calloc (banks, sizeof (resampler_t)) ;
+  events = evqueue_init (EVENT_QUEUE) ;
+  sem_init (&transport_sem, 0, 0) ;
+  voice_fade = calloc (banks * (RETRIGGER_FADE + 1), sample_size) ;
+  latency_probe = calloc (banks, sizeof (latency_probe_t)) ;
+  voice_pool = calloc (voice_pool_size + 1, sizeof (voice_t)) ;
+  pool_active = calloc (voice_pool_size + 1, sizeof (int)) ;
+
+  if( !stream_info || !head_info || !bank_load || !load_mutex || !info_in || !sndfile || !sndfile_in ||
+      !sndfileinfo || !sndfileinfo_in || !capture_record ||
+      !capture_mask || !preload_mode || !fifo_out || !fifo_in ||
+      !voice_pending || !active_voices || !voice_rs || !voice_fade ||
+      !events || !latency_probe || !voice_pool || !pool_active )
+    return 1;
+
+  for( bank = 0; bank < voice_pool_size; bank++ )
+    voice_pool[bank].bank = -1;
+
+  for( bank = 0; bank < banks; bank++ )
+    {
+      info[bank].quality = RESAMPLE_QUALITY;
+      info[bank].polyphony = 1;
+      info[bank].loop_fade = LOOP_FADE;
+      stream_info[bank].hint_fd = -1;
+      preload_mode[bank] = FICUS_PRELOAD_AUTO;
+      pthread_mutex_init(&load_mutex[bank], NULL);
+    }
+
+  return 0;
+} /* bank_setup */
+
+int
+stream_setup()
+{
+  /* start the streaming worker pool, one thread per core
+     unless ficus_stream_workers() asked for a number */
+  int count = 0;
+
+  if( stream_workers < 1 )
+    stream_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if( stream_workers < 1 )
+    stream_workers = 1;
+  if( stream_workers > num_banks )
+    stream_workers = num_banks;
+
+  stream_worker_id = (pthread_t *) malloc (sizeof (pthread_t) * stream_workers);
+  stream_worker_buf = (float *) malloc (sample_size * QUEUE_REFILL * stream_workers);
+  if( (stream_worker_id == NULL) || (stream_worker_buf == NULL) )
+    {
+      free (stream_worker_id) ;
+      free (stream_worker_buf) ;
+      stream_worker_id = NULL;
+      stream_worker_buf = NULL;
+      return 1;
+    }
+
+  stream_workers_run = 1;
+  for( count = 0; count < stream_workers; count++ )
+    pthread_create (&stream_worker_id[count], NULL, stream_worker,
+		    stream_worker_buf + (count * QUEUE_REFILL));
+
+  return 0;
+} /* stream_setup */
+
 int
 fifo_setup()
 {
   int count = 0;
+
+  queue_pool = rtqueue_pool_init(QUEUE_CHUNK, queue_pool_bytes);
+  if( queue_pool == NULL )
+    return 1;
   
-  for( count = 0; count < NUM_SAMPLES; count++)
-    fifo_out[count] = rtqueue_init(OUT_FRAMES);
+  for( count = 0; count < num_banks; count++)
+    if( (fifo_out[count] = rtqueue_init_pooled(queue_pool)) == NULL )
+      return 1;
 
-  for( count = 0; count < NUM_CHANNELS; count++)
-    fifo_in[count] = rtqueue_init(IN_FRAMES);
+  for( count = 0; count < num_channels; count++)
+    if( (fifo_in[count] = rtqueue_init_pooled(queue_pool)) == NULL )
+      return 1;
 
   return 0;
 } /* fifo_setup */
@@ -992,6 +3478,7 @@ set_callbacks()
 {
   /* Set up callbacks. */
   jack_set_process_callback (client, process, info) ;
+  jack_set_xrun_callback (client, xrun_count, NULL) ;
   jack_on_shutdown (client, jack_shutdown, 0) ;
   return 0;
 } /* set_callbacks */
@@ -1008,7 +3495,7 @@ activate_client()
   return 0;
 } /* activate_client */
 
-void
+int
 allocate_ports(int channels, int channels_in)
 {
   int i = 0;
@@ -1016,6 +3503,8 @@ allocate_ports(int channels, int channels_in)
   /* allocate output ports */
   output_port = calloc (channels, sizeof (jack_port_t *)) ;
   outs = calloc (channels, sizeof (jack_default_audio_sample_t *)) ;
+  if( (output_port == NULL) || (outs == NULL) )
+    return 1;
   for (i = 0 ; i < channels; i++)
     {     
       snprintf (name, sizeof (name), "out_%d", i + 1) ;
@@ -1026,6 +3515,8 @@ allocate_ports(int channels, int channels_in)
   size_t in_size = channels_in * sizeof (jack_default_audio_sample_t*);
   input_port = (jack_port_t **) malloc (sizeof (jack_port_t *) * channels_in);
   ins = (jack_default_audio_sample_t **) malloc (in_size);
+  if( (input_port == NULL) || (ins == NULL) )
+    return 1;
   memset(ins, 0, in_size);
   
   for( i = 0; i < channels_in; i++)
@@ -1034,6 +3525,8 @@ allocate_ports(int channels, int channels_in)
       snprintf( name, sizeof(name), "in_%d", i + 1);
       input_port[i] = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
     }
+
+  return 0;
 } /* allocate_ports */
 
 void
@@ -1041,6 +3534,10 @@ ficus_connect_channels(int channels_out, int channels_in)
 {
   int i = 0;
   char name [64] ;
+
+  if( render_offline )
+    return;
+
   /* auto connect all 'out' channels to 'system' (JACK-managed soundcard) */
   for (i = 0 ; i < channels_out ; i++)
     {       
@@ -1073,6 +3570,9 @@ ficus_jackmonitor(int channel_out, int channel_in, int state)
   char inport[65];
   char outport[65];
 
+  if( render_offline )
+    return 1;
+
   snprintf(inport, 65, "system:capture_%d", channel_out+1);
   snprintf(outport, 65, "system:playback_%d", channel_in+1);
 
@@ -1090,20 +3590,36 @@ ficus_jackmonitor(int channel_out, int channel_in, int state)
 } /* ficus_jackmonitor */
 
 int
-ficus_setup(char *client_name, char *path, char *prefix, int bit_depth)
+ficus_setup(char *client_name, char *path, char *prefix, int bit_depth,
+	    int banks, int channels)
 {
 
-  /* General Set-Up Method */
-  jack_setup(client_name);
+  /* General Set-Up Method. banks and channels are how many
+     of each this client has, 0 picks the compile-time default */
+  if (jack_setup(client_name) == 1)
+    return 1;
+
+  if (bank_setup(banks, channels) == 1)
+    return 1;
+
+  /* pick the fastest mixing kernel this cpu can run */
+  mixer_init();
+  resampler_init();
+  voice_setup();
   
-  fifo_setup();
+  if (fifo_setup() == 1)
+    return 1;
+  if (stream_setup() == 1)
+    return 1;
   set_callbacks();
  
-  allocate_ports(NUM_CHANNELS, NUM_CHANNELS);
+  if (allocate_ports(num_channels, num_channels) == 1)
+    return 1;
   if (activate_client() == 1)
     return 1;
 
-  setup_recbanks(path, prefix, bit_depth);
+  if (setup_recbanks(path, prefix, bit_depth) == 1)
+    return 1;
 
   pthread_create (&capture_thread_id, NULL, disk_thread_in, NULL);
 
@@ -1111,22 +3627,291 @@ ficus_setup(char *client_name, char *path, char *prefix, int bit_depth)
 
 } /* ficus_setup */
 
+int
+render_setup(int samplerate, int period)
+{
+  /* stand in for JACK. process() gets period sized buffers of
+     our own for every channel, ficus_render() writes them out */
+  if( samplerate < 1 )
+    samplerate = RENDER_RATE;
+  if( period < 1 )
+    period = RENDER_PERIOD;
+
+  render_offline = 1;
+  render_time = 0;
+  render_period = period;
+  jack_sr = samplerate;
+
+  return 0;
+} /* render_setup */
+
+int
+render_buffers()
+{
+  /* one buffer per output and input channel, plus room for
+     a period of interleaved frames from or for the disk */
+  int i;
+
+  outs = calloc (num_channels, sizeof (float *)) ;
+  ins = calloc (num_channels, sizeof (float *)) ;
+  render_frames = malloc (render_period * num_channels * sample_size) ;
+  render_stream_buf = malloc (QUEUE_REFILL * sample_size) ;
+  if( !outs || !ins || !render_frames || !render_stream_buf ||
+      posix_memalign((void **) &render_buf, 64,
+		     2 * num_channels * render_period * sample_size) )
+    return 1;
+  memset(render_buf, 0, 2 * num_channels * render_period * sample_size);
+
+  for( i = 0; i < num_channels; i++ )
+    {
+      outs[i] = render_buf + i * render_period;
+      ins[i] = render_buf + (num_channels + i) * render_period;
+    }
+
+  return 0;
+} /* render_buffers */
+
+int
+ficus_render_setup(char *path, char *prefix, int bit_depth, int banks,
+		   int channels, int samplerate, int period)
+{
+
+  /* Set-Up for rendering offline instead of running as a JACK
+     client. nothing plays until ficus_render() is called, which
+     runs the engine on the calling thread for as many frames 
+     as it's asked for.  samplerate and period (frames process()
+     renders at once) of 0 pick the compile-time default */
+  render_setup(samplerate, period);
+
+  if (bank_setup(banks, channels) == 1)
+    return 1;
+
+  mixer_init();
+  resampler_init();
+  voice_setup();
+
+  /* no streaming pool, ficus_render() reads ahead for every
+     streaming bank itself so the result is always the same */
+  if (fifo_setup() == 1)
+    return 1;
+  if (render_buffers() == 1)
+    return 1;
+
+  if (setup_recbanks(path, prefix, bit_depth) == 1)
+    return 1;
+
+  pthread_create (&capture_thread_id, NULL, disk_thread_in, NULL);
+
+  return 0;
+} /* ficus_render_setup */
+
+int
+ficus_render_open(char *out_path, char *in_path)
+{
+  /* out_path - WAV file ficus_render() writes every output
+     channel to as 32 bit float, NULL throws the audio away.
+     in_path - soundfile played into the input channels, one
+     channel each, NULL or once it runs out they're silent */
+  SF_INFO sfinfo;
+
+  if( !render_offline )
+    return 1;
+
+  ficus_render_close();
+  pthread_mutex_lock(&render_mutex);
+
+  if( out_path )
+    {
+      memset(&sfinfo, 0, sizeof (sfinfo));
+      sfinfo.samplerate = jack_sr;
+      sfinfo.channels = num_channels;
+      sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+      if( (render_out = sf_open(out_path, SFM_WRITE, &sfinfo)) == NULL )
+	{
+	  pthread_mutex_unlock(&render_mutex);
+	  return 1;
+	}
+    }
+
+  if( in_path )
+    {
+      memset(&sfinfo, 0, sizeof (sfinfo));
+      if( (render_in = sf_open(in_path, SFM_READ, &sfinfo)) == NULL )
+	{
+	  pthread_mutex_unlock(&render_mutex);
+	  ficus_render_close();
+	  return 1;
+	}
+      /* room to read a period of however many channels it has */
+      if( sfinfo.channels > num_channels )
+	{
+	  float *frames = realloc (render_frames, render_period * sfinfo.channels * sample_size) ;
+	  if( frames == NULL )
+	    {
+	      pthread_mutex_unlock(&render_mutex);
+	      ficus_render_close();
+	      return 1;
+	    }
+	  render_frames = frames;
+	}
+      render_in_channels = sfinfo.channels;
+    }
+
+  pthread_mutex_unlock(&render_mutex);
+
+  return 0;
+} /* ficus_render_open */
+
+void
+ficus_render_close()
+{
+  /* finish the WAV file ficus_render() writes to */
+  pthread_mutex_lock(&render_mutex);
+  if( render_out )
+    sf_close (render_out) ;
+  if( render_in )
+    sf_close (render_in) ;
+  render_out = NULL;
+  render_in = NULL;
+  render_in_channels = 0;
+  pthread_mutex_unlock(&render_mutex);
+} /* ficus_render_close */
+
+void
+render_input(jack_nframes_t nframes)
+{
+  /* fill the input channels with the next nframes of the
+     input soundfile, what it doesn't have is silence */
+  sf_count_t got = 0;
+  int i, c;
+
+  if( render_in )
+    {
+      got = sf_readf_float(render_in, render_frames, nframes);
+      if( got < 0 )
+	got = 0;
+    }
+
+  for( c = 0; c < num_channels; c++ )
+    {
+      if( c < render_in_channels )
+	for( i = 0; i < got; i++ )
+	  ins[c][i] = render_frames[i * render_in_channels + c];
+      else
+	i = 0;
+      memset(ins[c] + i, 0, (nframes - i) * sample_size);
+    }
+} /* render_input */
+
+void
+render_streams()
+{
+  /* do the streaming pool's work between periods, topping up
+     every streaming bank's queue and starting the ones that
+     were triggered, so the disk can never fall behind */
+  int bank;
+
+  while( (bank = stream_pick()) >= 0 )
+    {
+      stream_service(bank, render_stream_buf);
+      atomic_store(&stream_info[bank].claimed, 0);
+    }
+
+  stream_release_idle();
+} /* render_streams */
+
+int
+ficus_render(long frames)
+{
+  /* run the engine for 'frames' frames on this thread, a
+     period at a time, and write what it plays to the file
+     ficus_render_open() opened.  ficus_frame_time() moves
+     on by 'frames'. returns 1 if writing the file fails */
+  jack_nframes_t n;
+  int c, i, failed = 0;
+
+  if( !render_offline )
+    return 1;
+
+  while( frames > 0 )
+    {
+      n = frames < render_period ? frames : render_period;
+
+      /* a capture starts and ends on the same frames every time,
+	 we wait for the capture thread rather than drop input */
+      while( capture_armed() && !capture_thread_isrunning )
+	usleep(100);
+      while( capture_thread_isrunning &&
+	     (rtqueue_space(fifo_in[num_channels - 1]) < (int) n) )
+	usleep(100);
+
+      pthread_mutex_lock(&render_mutex);
+      render_input(n);
+      process(n, info);
+      render_time += n;
+
+      if( render_out )
+	{
+	  for( c = 0; c < num_channels; c++ )
+	    for( i = 0; i < n; i++ )
+	      render_frames[i * num_channels + c] = outs[c][i];
+	  if( sf_writef_float(render_out, render_frames, n) != n )
+	    failed = 1;
+	}
+      pthread_mutex_unlock(&render_mutex);
+
+      render_streams();
+      frames -= n;
+    }
+
+  return failed;
+} /* ficus_render */
+
 void
 ficus_clean()
 {
   int i = 0;
+
+  /* stop process() before freeing anything it uses */
+  if( render_offline )
+    {
+      ficus_render_close();
+      pthread_mutex_lock(&render_mutex);
+    }
+  else
+    jack_client_close (client) ;
+  process_stopped = 1;
+
+  /* stop the streaming pool */
+  stream_workers_run = 0;
+  stream_wake();
+  for(i=0; stream_worker_id && (i < stream_workers); i++)
+    pthread_join (stream_worker_id[i], NULL);
+  free (stream_worker_id) ;
+  stream_worker_id = NULL;
+  free (stream_worker_buf) ;
+  stream_worker_buf = NULL;
   
-  for(i=0; i < NUM_SAMPLES;i++)
+  for(i=0; i < num_banks;i++)
     {
       sf_close (sndfile[i]) ;
       sf_close (sndfile_in[i]);
+      free (stream_info[i].stream_buf) ;
+      free (stream_info[i].fade_buf) ;
+      wavmap_close (stream_info[i].wavmap) ;
+      if( stream_info[i].hint_fd >= 0 )
+	close (stream_info[i].hint_fd) ;
+      free (info[i].ram) ;
+      free (head_info[i].ram) ;
     }
 
   free (ins) ;
   free (outs) ;
   free (output_port) ;
   free (input_port) ;
-  jack_client_close (client) ;
+  free (render_buf) ;
+  free (render_frames) ;
+  free (render_stream_buf) ;
 
   return 0;
 } /* ficus_clean */
@@ -20,11 +20,36 @@ mrafoster at gmail dawtcom */
 #ifndef libficus_h__
 #define libficus_h__
 
-int ficus_setup(char *client_name, char *path, char *prefix, int bit_depth);
+int ficus_setup(char *client_name, char *path, char *prefix, int bit_depth,
+		int banks, int channels);
+int ficus_render_setup(char *path, char *prefix, int bit_depth, int banks,
+		       int channels, int samplerate, int period);
+int ficus_render_open(char *out_path, char *in_path);
+int ficus_render(long frames);
+void ficus_render_close();
+
+int ficus_numbanks();
+int ficus_numchannels();
 
 int ficus_loadfile(char *path, int bank_number);
 
+#define FICUS_PRELOAD_OFF 0
+#define FICUS_PRELOAD_ON 1
+#define FICUS_PRELOAD_AUTO 2
+
+int ficus_preload(int bank_number, int mode);
+int ficus_preload_budget(long bytes);
+int ficus_head_cache(int ms);
+int ficus_prefetch(int frames);
+
+int ficus_stream_workers(int workers);
+int ficus_queue_pool(long bytes);
+long ficus_queue_pool_available();
+int ficus_ispreloaded(int bank_number);
+
 int ficus_loop(int bank_number, int state);
+int ficus_loop_points(int bank_number, int start_frame, int end_frame);
+int ficus_loop_fade(int bank_number, int frames);
 
 int ficus_setmixout(int bank_number, int channel, int state);
 int ficus_setmixin(int bank_number, int channel, int state);
@@ -32,8 +57,85 @@ int ficus_setmixin(int bank_number, int channel, int state);
 int ficus_jackmonitor(int channel_out, int channel_in, int state);
 
 void ficus_playback(int bank_number);
+int ficus_polyphony(int bank_number, int voices);
+int ficus_voice_pool(int voices);
 void ficus_playback_speed(int bank_number, float speed);
 
+#define FICUS_RESAMPLE_LINEAR 0
+#define FICUS_RESAMPLE_CUBIC 1
+#define FICUS_RESAMPLE_SINC 2
+
+int ficus_playback_quality(int bank_number, int quality);
+
+#define FICUS_EVENT_TRIGGER 0
+#define FICUS_EVENT_STOP 1
+#define FICUS_EVENT_SPEED 2
+#define FICUS_EVENT_MIXOUT 3
+#define FICUS_EVENT_LOOP 4
+#define FICUS_EVENT_MIXIN 5
+#define FICUS_EVENT_RAMPUP 6
+#define FICUS_EVENT_RAMPDOWN 7
+#define FICUS_EVENT_QUALITY 8
+#define FICUS_EVENT_POLYPHONY 9
+#define FICUS_EVENT_LOOP_START 10
+#define FICUS_EVENT_LOOP_END 11
+#define FICUS_EVENT_LOOP_FADE 12
+
+unsigned int ficus_frame_time();
+int ficus_schedule(unsigned int frame, int type, int bank_number, int arg, float value);
+
+unsigned int ficus_transport_start(double bpm);
+void ficus_transport_stop();
+void ficus_transport_tempo(double bpm);
+int ficus_transport_wait(unsigned int *next_frame);
+int ficus_transport_isrolling();
+
+#define FICUS_SYNC_INTERNAL 0
+#define FICUS_SYNC_FOLLOW 1
+#define FICUS_SYNC_MASTER 2
+
+int ficus_transport_sync(int mode);
+
+typedef struct _ficus_stats
+{
+  unsigned long periods; /* times process() ran */
+  float dsp_min; /* microseconds process() took, since the last reset */
+  float dsp_avg;
+  float dsp_max;
+  float dsp_load; /* dsp_avg as a fraction of the period */
+  float dsp_peak; /* dsp_max as a fraction of the period */
+  unsigned long xruns;
+  unsigned long underruns; /* blocks streaming banks played short */
+  unsigned long capture_drops; /* input frames lost while capturing */
+  int voices; /* banks process() is playing */
+} ficus_stats_t;
+
+int ficus_get_stats(ficus_stats_t *stats, int reset);
+int ficus_queue_fill(int bank_number);
+unsigned int ficus_underruns(int bank_number);
+
+/* where a trigger came from */
+#define FICUS_LATENCY_PATH_MONOME 0
+#define FICUS_LATENCY_PATH_OSC 1
+#define FICUS_LATENCY_PATH_MIDI 2
+#define FICUS_LATENCY_PATH_OTHER 3
+#define FICUS_LATENCY_PATHS 4
+
+/* the hops it's timed at on its way out */
+#define FICUS_LATENCY_DISPATCH 0 /* ficus_playback() posted it */
+#define FICUS_LATENCY_APPLY 1 /* process() picked it up */
+#define FICUS_LATENCY_ENQUEUE 2 /* the disk queued the start of the file */
+#define FICUS_LATENCY_DEQUEUE 3 /* process() started playing it */
+#define FICUS_LATENCY_OUTPUT 4 /* its first sound left process() */
+#define FICUS_LATENCY_HOPS 5
+
+#define FICUS_LATENCY_BUCKETS 24
+
+int ficus_latency(int state);
+unsigned long long ficus_latency_clock();
+void ficus_latency_ingress(int bank_number, int path, unsigned long long ingress);
+unsigned long ficus_latency_histogram(int path, int hop, unsigned long *buckets);
+
 void ficus_playback_rampup(int bank_number, float rampduration);
 void ficus_playback_rampdown(int bank_number, float rampduration);
 
@@ -0,0 +1,164 @@
+/* mixer.c
+This file is a part of 'ficus'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+block mixing kernels for process().
+
+Copyright 2014 murray foster */
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MIXER_X86 1
+#include <immintrin.h>
+#endif
+
+#include "mixer.h"
+
+static void
+mix_scalar(float *out, const float *in, int nframes)
+{
+  int i;
+  for( i = 0; i < nframes; i++ )
+    out[i] += in[i];
+} /* mix_scalar */
+
+#ifdef MIXER_X86
+__attribute__((target("sse2")))
+static void
+mix_sse2(float *out, const float *in, int nframes)
+{
+  int i = 0;
+
+  /* JACK buffers are only guaranteed float alignment, 
+     so use unaligned loads/stores */
+  for( ; i + 8 <= nframes; i += 8 )
+    {
+      _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i),
+					 _mm_loadu_ps(in + i)));
+      _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_loadu_ps(out + i + 4),
+					     _mm_loadu_ps(in + i + 4)));
+    }
+  for( ; i < nframes; i++ )
+    out[i] += in[i];
+} /* mix_sse2 */
+
+__attribute__((target("avx2")))
+static void
+mix_avx2(float *out, const float *in, int nframes)
+{
+  int i = 0;
+
+  for( ; i + 16 <= nframes; i += 16 )
+    {
+      _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i),
+					       _mm256_loadu_ps(in + i)));
+      _mm256_storeu_ps(out + i + 8, _mm256_add_ps(_mm256_loadu_ps(out + i + 8),
+						   _mm256_loadu_ps(in + i + 8)));
+    }
+  for( ; i + 4 <= nframes; i += 4 )
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i),
+				       _mm_loadu_ps(in + i)));
+  for( ; i < nframes; i++ )
+    out[i] += in[i];
+} /* mix_avx2 */
+#endif
+
+static mixer_kernel_t mix_kernel = mix_scalar;
+static int mix_kernel_id = MIXER_SCALAR;
+
+int
+mixer_use(int kernel)
+{
+  switch( kernel )
+    {
+    case MIXER_SCALAR:
+      mix_kernel = mix_scalar;
+      break;
+#ifdef MIXER_X86
+    case MIXER_SSE2:
+      if( !__builtin_cpu_supports("sse2") )
+	return -1;
+      mix_kernel = mix_sse2;
+      break;
+    case MIXER_AVX2:
+      if( !__builtin_cpu_supports("avx2") )
+	return -1;
+      mix_kernel = mix_avx2;
+      break;
+#endif
+    default:
+      return -1;
+    }
+  mix_kernel_id = kernel;
+  return kernel;
+} /* mixer_use */
+
+int
+mixer_init()
+{
+#ifdef MIXER_X86
+  __builtin_cpu_init();
+  if( mixer_use(MIXER_AVX2) == MIXER_AVX2 )
+    return MIXER_AVX2;
+  if( mixer_use(MIXER_SSE2) == MIXER_SSE2 )
+    return MIXER_SSE2;
+#endif
+  return mixer_use(MIXER_SCALAR);
+} /* mixer_init */
+
+const char *
+mixer_name()
+{
+  switch( mix_kernel_id )
+    {
+    case MIXER_AVX2:
+      return "avx2";
+    case MIXER_SSE2:
+      return "sse2";
+    default:
+      return "scalar";
+    }
+} /* mixer_name */
+
+void
+mixer_block(float **outs, unsigned int mask, unsigned int offset,
+	    const float *in, int nframes)
+{
+  /* only visit the channels this voice is routed to */
+  while( mask )
+    {
+      mix_kernel(outs[__builtin_ctz(mask)] + offset, in, nframes);
+      mask &= mask - 1;
+    }
+} /* mixer_block */
+
+void
+mixer_sum(float *out, float **ins, unsigned int mask, int nframes)
+{
+  if( !mask )
+    {
+      memset(out, 0, nframes * sizeof(float));
+      return;
+    }
+
+  /* the first channel is copied, the rest added to it */
+  memcpy(out, ins[__builtin_ctz(mask)], nframes * sizeof(float));
+  mask &= mask - 1;
+  while( mask )
+    {
+      mix_kernel(out, ins[__builtin_ctz(mask)], nframes);
+      mask &= mask - 1;
+    }
+} /* mixer_sum */
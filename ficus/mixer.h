@@ -0,0 +1,48 @@
+/* mixer.h
+This file is a part of 'ficus'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+'mixer' adds a block of voice samples into every output buffer
+a bank is routed to.  routing is a bitmask of channels, bit n
+set means the voice plays thru channel n.
+
+mixer_init() picks the fastest kernel this cpu supports, after
+that mixer_block() is safe to call from the JACK process() 
+callback.
+
+Copyright 2014 murray foster */
+
+#ifndef mixer_h__
+#define mixer_h__
+
+#define MIXER_SCALAR 0
+#define MIXER_SSE2 1
+#define MIXER_AVX2 2
+
+typedef void (*mixer_kernel_t)(float *out, const float *in, int nframes);
+
+/* choose a kernel, returns MIXER_SCALAR/SSE2/AVX2 */
+int mixer_init();
+/* force a kernel, returns -1 if this cpu can't run it */
+int mixer_use(int kernel);
+/* name of the kernel in use, for printing */
+const char *mixer_name();
+
+/* add nframes of 'in' into outs[n] + offset for every bit n in mask */
+void mixer_block(float **outs, unsigned int mask, unsigned int offset,
+		 const float *in, int nframes);
+
+/* set 'out' to the sum of ins[n] for every bit n in mask */
+void mixer_sum(float *out, float **ins, unsigned int mask, int nframes);
+
+#endif
@@ -0,0 +1,215 @@
+/* resampler.c
+This file is a part of 'ficus'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+varispeed playback for process().
+
+Copyright 2014 murray foster */
+
+#include <math.h>
+#include <string.h>
+
+#include "resampler.h"
+
+/* fractional positions the sinc kernel is tabulated at */
+#define SINC_PHASES 512
+/* lowpass the kernel a little below nyquist */
+#define SINC_CUTOFF 0.92
+
+#define SINC_TAPS RESAMPLER_HISTORY
+
+static float sinc_table[SINC_PHASES + 1][SINC_TAPS] __attribute__((aligned(64)));
+
+void
+resampler_init()
+{
+  /* tabulate a blackman windowed sinc for every phase, tap k
+     of a phase weighs the source frame (k - HALF + 1) frames
+     from the read position */
+  int phase, k;
+  double x, w, sum;
+
+  for( phase = 0; phase <= SINC_PHASES; phase++ )
+    {
+      sum = 0;
+      for( k = 0; k < SINC_TAPS; k++ )
+	{
+	  x = (k - RESAMPLER_HALF + 1) - (double)phase / SINC_PHASES;
+	  if( x == 0 )
+	    sinc_table[phase][k] = SINC_CUTOFF;
+	  else
+	    sinc_table[phase][k] = sin(M_PI * x * SINC_CUTOFF) / (M_PI * x);
+	  /* blackman window, spanning -HALF .. HALF */
+	  w = 0.42 + 0.5 * cos(M_PI * x / RESAMPLER_HALF) +
+	    0.08 * cos(2 * M_PI * x / RESAMPLER_HALF);
+	  if( fabs(x) >= RESAMPLER_HALF )
+	    w = 0;
+	  sinc_table[phase][k] *= w;
+	  sum += sinc_table[phase][k];
+	}
+      /* unity gain at dc */
+      for( k = 0; k < SINC_TAPS; k++ )
+	sinc_table[phase][k] /= sum;
+    }
+} /* resampler_init */
+
+void
+resampler_reset(resampler_t *rs)
+{
+  /* silence before the stream, the first frame read is
+     the first new one */
+  memset(rs->history, 0, sizeof(rs->history));
+  rs->pos = RESAMPLER_HISTORY;
+  rs->ended = 0;
+  rs->end = 0;
+} /* resampler_reset */
+
+double
+resampler_speed(double speed)
+{
+  if( !(speed >= RESAMPLER_MIN_SPEED) )
+    return RESAMPLER_MIN_SPEED;
+  if( speed > RESAMPLER_MAX_SPEED )
+    return RESAMPLER_MAX_SPEED;
+  return speed;
+} /* resampler_speed */
+
+int
+resampler_need(resampler_t *rs, int nframes, double speed)
+{
+  /* the last frame of the block reads up to HALF frames ahead
+     of its position, everything past the history is new */
+  int need;
+
+  need = (int)floor(rs->pos + (nframes - 1) * speed) + RESAMPLER_HALF + 1
+    - RESAMPLER_HISTORY;
+
+  return need > 0 ? need : 0;
+} /* resampler_need */
+
+void
+resampler_end(resampler_t *rs, int got)
+{
+  /* only the first short read marks the end, after that
+     everything is padding */
+  if( !rs->ended )
+    {
+      rs->ended = 1;
+      rs->end = RESAMPLER_HISTORY + got;
+    }
+} /* resampler_end */
+
+int
+resampler_done(resampler_t *rs)
+{
+  return rs->ended && (rs->pos >= rs->end);
+} /* resampler_done */
+
+static void
+run_linear(const float *src, double pos, double speed, float *out, int nframes)
+{
+  int i, c;
+  float f;
+
+  for( i = 0; i < nframes; i++ )
+    {
+      c = (int)pos;
+      f = pos - c;
+      out[i] = src[c] + (src[c + 1] - src[c]) * f;
+      pos += speed;
+    }
+} /* run_linear */
+
+static void
+run_cubic(const float *src, double pos, double speed, float *out, int nframes)
+{
+  /* catmull-rom spline thru the four nearest source frames */
+  int i, c;
+  float f, a, b, d, e;
+
+  for( i = 0; i < nframes; i++ )
+    {
+      c = (int)pos;
+      f = pos - c;
+      a = src[c - 1];
+      b = src[c];
+      d = src[c + 1];
+      e = src[c + 2];
+      out[i] = b + 0.5f * f * (d - a + f * (2.0f * a - 5.0f * b + 4.0f * d - e +
+					    f * (3.0f * (b - d) + e - a)));
+      pos += speed;
+    }
+} /* run_cubic */
+
+static void
+run_sinc(const float *src, double pos, double speed, float *out, int nframes)
+{
+  /* blend the two nearest tabulated phases, the tap loops 
+     have a fixed length so the compiler vectorizes them */
+  int i, k, c, phase;
+  float f, a, s0, s1;
+  const float *w, *t0, *t1;
+
+  for( i = 0; i < nframes; i++ )
+    {
+      c = (int)pos;
+      f = (pos - c) * SINC_PHASES;
+      phase = (int)f;
+      a = f - phase;
+      w = src + c - RESAMPLER_HALF + 1;
+      t0 = sinc_table[phase];
+      t1 = sinc_table[phase + 1];
+      s0 = 0;
+      s1 = 0;
+      for( k = 0; k < SINC_TAPS; k++ )
+	{
+	  s0 += w[k] * t0[k];
+	  s1 += w[k] * t1[k];
+	}
+      out[i] = s0 + (s1 - s0) * a;
+      pos += speed;
+    }
+} /* run_sinc */
+
+void
+resampler_run(resampler_t *rs, int quality, float *src, int nsrc,
+	      float *out, int nframes, double speed)
+{
+  /* 'src' holds nsrc new frames after RESAMPLER_HISTORY free 
+     ones, which we fill with what we kept from last time */
+  memcpy(src, rs->history, sizeof(rs->history));
+
+  if( (speed == 1.0) && (rs->pos == (int)rs->pos) )
+    /* straight playback lands on source frames, just copy */
+    memcpy(out, src + (int)rs->pos, nframes * sizeof(float));
+  else
+    switch( quality )
+      {
+      case RESAMPLER_LINEAR:
+	run_linear(src, rs->pos, speed, out, nframes);
+	break;
+      case RESAMPLER_SINC:
+	run_sinc(src, rs->pos, speed, out, nframes);
+	break;
+      default:
+	run_cubic(src, rs->pos, speed, out, nframes);
+	break;
+      }
+
+  /* keep the tail for the next block and move our
+     position (and the end, if we know it) along with it */
+  memcpy(rs->history, src + nsrc, sizeof(rs->history));
+  rs->pos += nframes * speed - nsrc;
+  if( rs->ended )
+    rs->end -= nsrc;
+} /* resampler_run */
@@ -0,0 +1,74 @@
+/* resampler.h
+This file is a part of 'ficus'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+'resampler' plays a stream of source frames back at any speed.
+a fractional read position moves thru the source 'speed' frames
+for every frame of output, values between source frames are
+interpolated (linear, cubic or windowed-sinc).
+
+every call works on a whole block.  the caller asks 
+resampler_need() how many new source frames the next block
+takes, writes them to 'src' + RESAMPLER_HISTORY and hands the
+lot to resampler_run().  nothing here blocks or allocates, so
+it's safe to use from the JACK process() callback.
+
+Copyright 2014 murray foster */
+
+#ifndef resampler_h__
+#define resampler_h__
+
+#define RESAMPLER_LINEAR 0
+#define RESAMPLER_CUBIC 1
+#define RESAMPLER_SINC 2
+
+/* source frames the sinc kernel reaches on either side */
+#define RESAMPLER_HALF 8
+/* source frames kept between blocks */
+#define RESAMPLER_HISTORY (RESAMPLER_HALF * 2)
+/* speeds are clamped to this range */
+#define RESAMPLER_MIN_SPEED (1.0 / 64)
+#define RESAMPLER_MAX_SPEED 16
+
+/* room 'src' needs for a block of nframes */
+#define RESAMPLER_SRC_FRAMES(nframes) \
+  (RESAMPLER_HISTORY + (nframes) * RESAMPLER_MAX_SPEED + RESAMPLER_HALF + 2)
+
+typedef struct resampler
+{
+  /* the last source frames of the previous block */
+  float history[RESAMPLER_HISTORY];
+  /* read position, counted from the start of 'src' */
+  double pos;
+  /* where the source ran out, if it has */
+  int ended;
+  double end;
+} resampler_t;
+
+/* build the sinc tables, call once before anything else */
+void resampler_init();
+/* forget everything, the next frame read is the first of a new stream */
+void resampler_reset(resampler_t *rs);
+/* new source frames needed to render nframes at 'speed' */
+int resampler_need(resampler_t *rs, int nframes, double speed);
+/* the source ended 'got' frames into this block, the rest are zeros */
+void resampler_end(resampler_t *rs, int got);
+/* render nframes into 'out', 'nsrc' is what resampler_need() returned */
+void resampler_run(resampler_t *rs, int quality, float *src, int nsrc,
+		   float *out, int nframes, double speed);
+/* 1 once the read position has passed the end of the source */
+int resampler_done(resampler_t *rs);
+/* clamp a speed multiplier to what the resampler supports */
+double resampler_speed(double speed);
+
+#endif
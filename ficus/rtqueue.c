@@ -12,58 +12,320 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-'rtqueue' is a simple FIFO linked list intended to hold 
-JACK sample data for process()'ing.
+'rtqueue' is a wait-free single-producer/single-consumer ring 
+intended to hold JACK sample data for process()'ing.
 
 Copyright 2014 murray foster */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <jack/jack.h>
 #include <pthread.h>
 
-int dequeue_is_waiting = 0;
-pthread_mutex_t dequeue_is_waiting_mutex;
-pthread_cond_t dequeue_is_waiting_cond;
+#include "rtqueue.h"
 
-int enqueue_is_waiting = 0;
-pthread_mutex_t enqueue_is_waiting_mutex;
-pthread_cond_t enqueue_is_waiting_cond;
+/* what a sleeping disk-side thread is waiting for */
+#define RTQUEUE_WAIT_SPACE 1
+#define RTQUEUE_WAIT_RECORDS 2
+
+/* a sleeper re-checks the queue on its own this often (in ns),
+   in case the other side couldn't wake it without blocking */
+#define RTQUEUE_WAIT_NSEC 50000000
 
 /* JACK sample size, set by JACK server */
 const size_t smpl_size = sizeof (jack_default_audio_sample_t) ;
 
-typedef struct queue
+static unsigned int
+rtqueue_log2(unsigned int size)
+{
+  unsigned int shift = 0;
+
+  while ((1u << shift) < size)
+    shift++;
+  return shift;
+}
+
+static rtqueue_t *
+rtqueue_new()
 {
-  int head;
-  int tail;
-  int recordlimit;
-  int records;
-  float *queue;
-} rtqueue_t;
+  rtqueue_t *rtq;
+
+  if (posix_memalign((void **) &rtq, RTQUEUE_CACHELINE, sizeof(rtqueue_t)))
+    return NULL;
+  memset(rtq, 0, sizeof(rtqueue_t));
+
+  atomic_init(&rtq->head, 0);
+  atomic_init(&rtq->tail, 0);
+  atomic_init(&rtq->waiting, 0);
+  pthread_mutex_init(&rtq->wait_mutex, NULL);
+  pthread_cond_init(&rtq->wait_cond, NULL);
+
+  return rtq;
+}
 
 rtqueue_t *
 rtqueue_init(int recordlimit)
 {
-  rtqueue_t *rtq = (rtqueue_t *) malloc(sizeof(rtqueue_t));
-  rtq->queue = (float *) malloc(smpl_size * (recordlimit + 1));
-  rtq->head = 0;
-  rtq->tail = 0;
-  rtq->recordlimit = recordlimit;
+  /* a queue with memory of its own, in one chunk */
+  rtqueue_t *rtq;
+  unsigned int size;
+
+  /* round up to a power of two so indices wrap with a mask */
+  size = 1u << rtqueue_log2(recordlimit);
+
+  if ((rtq = rtqueue_new()) == NULL)
+    return NULL;
+
+  if (posix_memalign((void **) &rtq->chunk[0], RTQUEUE_CACHELINE, smpl_size * size))
+    {
+      free(rtq);
+      return NULL;
+    }
+
+  rtq->chunks = 1;
+  rtq->chunk_shift = rtqueue_log2(size);
+  rtq->chunk_mask = size - 1;
+  rtq->mask = size - 1;
+  rtq->recordlimit = size;
+
+  return rtq;
+}
+
+rtqueue_pool_t *
+rtqueue_pool_init(int chunk_frames, long bytes)
+{
+  /* set aside 'bytes' of queue memory in chunks of chunk_frames
+     records (rounded up to a power of two).  pages are only
+     touched once a queue borrows them */
+  rtqueue_pool_t *pool;
+  int c;
+
+  if ((pool = calloc(1, sizeof(rtqueue_pool_t))) == NULL)
+    return NULL;
+
+  pool->chunk_frames = 1 << rtqueue_log2(chunk_frames);
+  pool->chunks = bytes / (pool->chunk_frames * smpl_size);
+  if (pool->chunks < 1)
+    pool->chunks = 1;
+
+  pool->next = malloc(sizeof(int) * pool->chunks);
+  if ((pool->next == NULL) ||
+      posix_memalign((void **) &pool->memory, RTQUEUE_CACHELINE,
+		     smpl_size * pool->chunk_frames * pool->chunks))
+    {
+      free(pool->next);
+      free(pool);
+      return NULL;
+    }
+
+  /* chain every chunk onto the free list */
+  for (c = 0; c < pool->chunks; c++)
+    pool->next[c] = c + 2 <= pool->chunks ? c + 2 : 0;
+  atomic_init(&pool->top, 1);
+  atomic_init(&pool->available, pool->chunks);
+  atomic_init(&pool->failures, 0);
+
+  return pool;
+}
+
+static int
+rtqueue_pool_pop(rtqueue_pool_t *pool)
+{
+  /* take a chunk off the free list, -1 if there are none.
+     the tag keeps a chunk that went away and came back
+     from fooling the compare-and-swap */
+  unsigned long long top, next;
+  int chunk;
+
+  top = atomic_load(&pool->top);
+  do
+    {
+      if ((top & 0xffffffffULL) == 0)
+	return -1;
+      chunk = (int)(top & 0xffffffffULL) - 1;
+      next = ((top >> 32) + 1) << 32 | (unsigned int) pool->next[chunk];
+    }
+  while (!atomic_compare_exchange_weak(&pool->top, &top, next));
+
+  atomic_fetch_sub(&pool->available, 1);
+  return chunk;
+}
+
+static void
+rtqueue_pool_push(rtqueue_pool_t *pool, int chunk)
+{
+  /* put a chunk back, never blocks */
+  unsigned long long top, next;
+
+  top = atomic_load(&pool->top);
+  do
+    {
+      pool->next[chunk] = (int)(top & 0xffffffffULL);
+      next = ((top >> 32) + 1) << 32 | (unsigned int)(chunk + 1);
+    }
+  while (!atomic_compare_exchange_weak(&pool->top, &top, next));
+
+  atomic_fetch_add(&pool->available, 1);
+}
+
+int
+rtqueue_pool_available(rtqueue_pool_t *pool)
+{
+  return atomic_load(&pool->available);
+}
+
+long
+rtqueue_pool_failures(rtqueue_pool_t *pool)
+{
+  return atomic_load(&pool->failures);
+}
+
+rtqueue_t *
+rtqueue_init_pooled(rtqueue_pool_t *pool)
+{
+  /* a queue without memory, see rtqueue_attach() */
+  rtqueue_t *rtq;
+
+  if ((rtq = rtqueue_new()) == NULL)
+    return NULL;
+  rtq->pool = pool;
+
   return rtq;
 }
 
+int
+rtqueue_attach(rtqueue_t *rtq, int recordlimit)
+{
+  /* borrow enough chunks from the pool to hold recordlimit
+     records and start out empty.  returns 1, with nothing
+     borrowed, if the pool can't spare them */
+  rtqueue_pool_t *pool = rtq->pool;
+  int chunks = 1;
+  int c, chunk;
+
+  if (pool == NULL)
+    return 1;
+  if (rtq->chunks)
+    return 0;
+
+  while ((chunks < RTQUEUE_MAX_CHUNKS) &&
+	 (chunks * pool->chunk_frames < recordlimit))
+    chunks <<= 1;
+
+  for (c = 0; c < chunks; c++)
+    {
+      if ((chunk = rtqueue_pool_pop(pool)) < 0)
+	{
+	  while (c--)
+	    rtqueue_pool_push(pool, rtq->chunk_index[c]);
+	  atomic_fetch_add(&pool->failures, 1);
+	  return 1;
+	}
+      rtq->chunk_index[c] = chunk;
+      rtq->chunk[c] = pool->memory + (long) chunk * pool->chunk_frames;
+    }
+
+  atomic_store(&rtq->head, 0);
+  atomic_store(&rtq->tail, 0);
+  rtq->chunk_shift = rtqueue_log2(pool->chunk_frames);
+  rtq->chunk_mask = pool->chunk_frames - 1;
+  rtq->mask = chunks * pool->chunk_frames - 1;
+  rtq->chunks = chunks;
+  atomic_thread_fence(memory_order_release);
+  rtq->recordlimit = chunks * pool->chunk_frames;
+
+  return 0;
+}
+
+void
+rtqueue_detach(rtqueue_t *rtq)
+{
+  /* give the queue's chunks back to the pool.  the consumer
+     must be done with the queue, whatever's queued is lost */
+  int c;
+
+  if (rtq->pool == NULL || rtq->chunks == 0)
+    return;
+
+  rtq->recordlimit = 0;
+  atomic_thread_fence(memory_order_release);
+  atomic_store(&rtq->head, 0);
+  atomic_store(&rtq->tail, 0);
+
+  for (c = 0; c < rtq->chunks; c++)
+    {
+      rtqueue_pool_push(rtq->pool, rtq->chunk_index[c]);
+      rtq->chunk[c] = NULL;
+    }
+  rtq->chunks = 0;
+}
+
+int
+rtqueue_isattached(rtqueue_t *rtq)
+{
+  return rtq->chunks != 0;
+}
+
+static void
+rtqueue_copy_in(rtqueue_t *rtq, unsigned int index, const float *data, unsigned int n)
+{
+  /* copy into the ring from 'index' on, a chunk's span at a time */
+  unsigned int slot, offset, span;
+
+  while (n > 0)
+    {
+      slot = index & rtq->mask;
+      offset = slot & rtq->chunk_mask;
+      span = rtq->chunk_mask + 1 - offset;
+      if (span > n)
+	span = n;
+      memcpy(rtq->chunk[slot >> rtq->chunk_shift] + offset, data, span * smpl_size);
+      index += span;
+      data += span;
+      n -= span;
+    }
+}
+
+static void
+rtqueue_copy_out(rtqueue_t *rtq, unsigned int index, float *data, unsigned int n)
+{
+  /* copy out of the ring from 'index' on, a chunk's span at a time */
+  unsigned int slot, offset, span;
+
+  while (n > 0)
+    {
+      slot = index & rtq->mask;
+      offset = slot & rtq->chunk_mask;
+      span = rtq->chunk_mask + 1 - offset;
+      if (span > n)
+	span = n;
+      memcpy(data, rtq->chunk[slot >> rtq->chunk_shift] + offset, span * smpl_size);
+      index += span;
+      data += span;
+      n -= span;
+    }
+}
+
 int
 rtqueue_numrecords(rtqueue_t *rtq)
 {
-  return rtq->records;
+  return atomic_load_explicit(&rtq->tail, memory_order_acquire) -
+    atomic_load_explicit(&rtq->head, memory_order_acquire);
+}
+
+int
+rtqueue_space(rtqueue_t *rtq)
+{
+  return rtq->recordlimit - rtqueue_numrecords(rtq);
 }
 
 int
 rtqueue_isfull(rtqueue_t *rtq)
 {
   /* if queue is full, return 1 */
-  if ((rtq->tail + 1) % (rtq->recordlimit + 1) == rtq->head)
+  if (rtqueue_numrecords(rtq) == rtq->recordlimit)
     return 1;
   else
     return 0;
@@ -73,31 +335,192 @@ int
 rtqueue_isempty(rtqueue_t *rtq)
 {
   /* if queue is empty, return 1 */
-  if (rtq->head == rtq->tail)
+  if (rtqueue_numrecords(rtq) == 0)
     return 1;
   else
     return 0;
 }
 
+static void
+rtqueue_notify(rtqueue_t *rtq, int side)
+{
+  /* wake the disk-side thread sleeping on this queue once what
+     it's waiting for is there.  this never blocks: if we can't
+     get the lock the sleeper is busy checking for itself */
+  if (atomic_load(&rtq->waiting) != side)
+    return;
+
+  if (side == RTQUEUE_WAIT_SPACE && rtqueue_space(rtq) < rtq->want)
+    return;
+
+  if (side == RTQUEUE_WAIT_RECORDS && rtqueue_numrecords(rtq) < rtq->want)
+    return;
+
+  if (pthread_mutex_trylock(&rtq->wait_mutex) == 0)
+    {
+      pthread_cond_signal(&rtq->wait_cond);
+      pthread_mutex_unlock(&rtq->wait_mutex);
+    }
+}
+
 int
-rtqueue_enq(rtqueue_t *rtq, float data)
+rtqueue_enq_n(rtqueue_t *rtq, const float *data, int n)
 {
-  /* if queue is full, wait */
-  if ((rtq->tail + 1) % (rtq->recordlimit + 1) == rtq->head)
+  /* queue up to n records, returns how many fit */
+  unsigned int tail = atomic_load_explicit(&rtq->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&rtq->head, memory_order_acquire);
+  int space = rtq->recordlimit - (int)(tail - head);
+
+  if (n > space)
+    n = space;
+  if (n <= 0)
+    return 0;
+
+  rtqueue_copy_in(rtq, tail, data, n);
+
+  atomic_store_explicit(&rtq->tail, tail + n, memory_order_release);
+  rtqueue_notify(rtq, RTQUEUE_WAIT_RECORDS);
+
+  return n;
+}
+
+int
+rtqueue_deq_n(rtqueue_t *rtq, float *data, int n)
+{
+  /* dequeue up to n records, returns how many there were */
+  unsigned int head = atomic_load_explicit(&rtq->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&rtq->tail, memory_order_acquire);
+  int records = tail - head;
+
+  if (n > records)
+    n = records;
+  if (n <= 0)
+    return 0;
+
+  rtqueue_copy_out(rtq, head, data, n);
+
+  atomic_store_explicit(&rtq->head, head + n, memory_order_release);
+  rtqueue_notify(rtq, RTQUEUE_WAIT_SPACE);
+
+  return n;
+}
+
+int
+rtqueue_tryenq(rtqueue_t *rtq, float data)
+{
+  /* if queue is full, return 1 */
+  return rtqueue_enq_n(rtq, &data, 1) != 1;
+}
+
+int
+rtqueue_trydeq(rtqueue_t *rtq, float *data)
+{
+  /* if queue is empty, return 1 */
+  return rtqueue_deq_n(rtq, data, 1) != 1;
+}
+
+void
+rtqueue_drain(rtqueue_t *rtq)
+{
+  /* drop everything queued so far, consumer side only */
+  atomic_store_explicit(&rtq->head,
+			atomic_load_explicit(&rtq->tail, memory_order_acquire),
+			memory_order_release);
+  rtqueue_notify(rtq, RTQUEUE_WAIT_SPACE);
+}
+
+unsigned int
+rtqueue_mark(rtqueue_t *rtq)
+{
+  /* where the next record will be queued, producer side only */
+  return atomic_load_explicit(&rtq->tail, memory_order_relaxed);
+}
+
+void
+rtqueue_seek(rtqueue_t *rtq, unsigned int mark)
+{
+  /* drop everything queued before a rtqueue_mark(), consumer
+     side only.  a mark we've already read past is ignored */
+  unsigned int head = atomic_load_explicit(&rtq->head, memory_order_relaxed);
+
+  if( (int)(mark - head) <= 0 )
+    return;
+  atomic_store_explicit(&rtq->head, mark, memory_order_release);
+  rtqueue_notify(rtq, RTQUEUE_WAIT_SPACE);
+}
+
+static int
+rtqueue_wait(rtqueue_t *rtq, int side, int n)
+{
+  /* sleep until n records/free slots are available, we're woken
+     by rtqueue_wake() or a while has passed. returns 0 if they
+     are available */
+  struct timespec ts;
+  int ready;
+
+  if (n > rtq->recordlimit)
+    n = rtq->recordlimit;
+
+  pthread_mutex_lock(&rtq->wait_mutex);
+  rtq->want = n;
+  atomic_store(&rtq->waiting, side);
+
+  if (side == RTQUEUE_WAIT_SPACE)
+    ready = rtqueue_space(rtq) >= n;
+  else
+    ready = rtqueue_numrecords(rtq) >= n;
+
+  if (!ready)
     {
-      enqueue_is_waiting = 1;
-      pthread_mutex_lock(&enqueue_is_waiting_mutex);
-      pthread_cond_wait(&enqueue_is_waiting_cond, &enqueue_is_waiting_mutex);
-      pthread_mutex_unlock(&enqueue_is_waiting_mutex); 
-      enqueue_is_waiting = 0;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += RTQUEUE_WAIT_NSEC;
+      if (ts.tv_nsec >= 1000000000)
+	{
+	  ts.tv_sec += 1;
+	  ts.tv_nsec -= 1000000000;
+	}
+      pthread_cond_timedwait(&rtq->wait_cond, &rtq->wait_mutex, &ts);
+
+      if (side == RTQUEUE_WAIT_SPACE)
+	ready = rtqueue_space(rtq) >= n;
+      else
+	ready = rtqueue_numrecords(rtq) >= n;
     }
 
-  rtq->queue[rtq->tail] = data;
-  rtq->tail = (rtq->tail + 1) % (rtq->recordlimit + 1);
-  rtq->records+=1;
+  atomic_store(&rtq->waiting, 0);
+  pthread_mutex_unlock(&rtq->wait_mutex);
 
-  if (dequeue_is_waiting)
-    pthread_cond_signal(&dequeue_is_waiting_cond);
+  return !ready;
+}
+
+int
+rtqueue_wait_space(rtqueue_t *rtq, int n)
+{
+  return rtqueue_wait(rtq, RTQUEUE_WAIT_SPACE, n);
+}
+
+int
+rtqueue_wait_records(rtqueue_t *rtq, int n)
+{
+  return rtqueue_wait(rtq, RTQUEUE_WAIT_RECORDS, n);
+}
+
+void
+rtqueue_wake(rtqueue_t *rtq)
+{
+  /* interrupt a sleeping disk-side thread, e.g. to make it
+     notice it has been killed */
+  pthread_mutex_lock(&rtq->wait_mutex);
+  pthread_cond_signal(&rtq->wait_cond);
+  pthread_mutex_unlock(&rtq->wait_mutex);
+}
+
+int
+rtqueue_enq(rtqueue_t *rtq, float data)
+{
+  /* if queue is full, wait */
+  while (rtqueue_tryenq(rtq, data))
+    rtqueue_wait_space(rtq, 1);
 
   return 0;
 }
@@ -108,22 +531,8 @@ rtqueue_deq(rtqueue_t *rtq)
   float data;
 
   /* if queue is empty, wait */
-  while (rtq->head == rtq->tail)
-    {
-      dequeue_is_waiting = 1;
-      pthread_mutex_lock(&dequeue_is_waiting_mutex);
-      pthread_cond_wait(&dequeue_is_waiting_cond, &dequeue_is_waiting_mutex);
-      pthread_mutex_unlock(&dequeue_is_waiting_mutex); 
-      dequeue_is_waiting = 0;
-    }
-
-  /* dequeue and return data at the head */
-  data = rtq->queue[rtq->head];
-  rtq->head = (rtq->head + 1) % (rtq->recordlimit + 1);
-  rtq->records-=1;
-
-  if (enqueue_is_waiting)
-    pthread_cond_signal(&enqueue_is_waiting_cond);
+  while (rtqueue_trydeq(rtq, &data))
+    rtqueue_wait_records(rtq, 1);
 
   return data;
 }
@@ -12,33 +12,104 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-'rtqueue' is a simple FIFO linked list intended to hold 
-JACK sample data for process()'ing.
+'rtqueue' is a wait-free single-producer/single-consumer ring 
+intended to hold JACK sample data for process()'ing.
+
+the rtqueue_try*(), *_n(), rtqueue_drain() and rtqueue_seek() 
+calls never block and are safe to use from the JACK process() 
+callback.  the blocking calls are meant for the disk side only,
+they sleep until the other side makes room or data.
 
 Copyright 2014 murray foster */
 
 #ifndef rtqueue_h__
 #define rtqueue_h__
 
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define RTQUEUE_CACHELINE 64
+/* most chunks a pooled queue can borrow */
+#define RTQUEUE_MAX_CHUNKS 64
+
+/* a pool of fixed-size chunks of queue memory, shared by
+   queues that only hold memory while they're in use */
+typedef struct queue_pool
+{
+  float *memory;
+  int chunk_frames;
+  int chunks;
+  int *next;
+  /* free list, (tag << 32) | (chunk + 1), 0 when it's empty */
+  _Alignas(RTQUEUE_CACHELINE) atomic_ullong top;
+  atomic_int available;
+  atomic_long failures;
+} rtqueue_pool_t;
+
 typedef struct queue
 {
-  int head;
-  int tail;
+  /* advanced by the consumer only */
+  _Alignas(RTQUEUE_CACHELINE) atomic_uint head;
+  /* advanced by the producer only */
+  _Alignas(RTQUEUE_CACHELINE) atomic_uint tail;
+  /* read-only after rtqueue_init() or rtqueue_attach() */
+  _Alignas(RTQUEUE_CACHELINE) unsigned int mask;
   int recordlimit;
-  int records;
-  float *queue;
+  unsigned int chunk_shift;
+  unsigned int chunk_mask;
+  int chunks;
+  float *chunk[RTQUEUE_MAX_CHUNKS];
+  int chunk_index[RTQUEUE_MAX_CHUNKS];
+  rtqueue_pool_t *pool;
+  /* lets one disk-side thread sleep on this queue */
+  atomic_int waiting;
+  int want;
+  pthread_mutex_t wait_mutex;
+  pthread_cond_t wait_cond;
 } rtqueue_t;
 
 rtqueue_t *rtqueue_init(int recordlimit);
 
+/* pooled queues hold no memory until they're attached. only
+   attach or detach while neither side is using the queue */
+rtqueue_pool_t *rtqueue_pool_init(int chunk_frames, long bytes);
+int rtqueue_pool_available(rtqueue_pool_t *pool);
+long rtqueue_pool_failures(rtqueue_pool_t *pool);
+
+rtqueue_t *rtqueue_init_pooled(rtqueue_pool_t *pool);
+int rtqueue_attach(rtqueue_t *rtq, int recordlimit);
+void rtqueue_detach(rtqueue_t *rtq);
+int rtqueue_isattached(rtqueue_t *rtq);
+
 int rtqueue_numrecords(rtqueue_t *rtq);
+int rtqueue_space(rtqueue_t *rtq);
 
 int rtqueue_isfull(rtqueue_t *rtq);
 
 int rtqueue_isempty(rtqueue_t *rtq);
 
+/* non-blocking, for the audio side */
+int rtqueue_tryenq(rtqueue_t *rtq, float data);
+int rtqueue_trydeq(rtqueue_t *rtq, float *data);
+
+int rtqueue_enq_n(rtqueue_t *rtq, const float *data, int n);
+int rtqueue_deq_n(rtqueue_t *rtq, float *data, int n);
+
+void rtqueue_drain(rtqueue_t *rtq);
+
+/* drop records in O(1), the producer marks a spot and the 
+   consumer later skips everything queued before it */
+unsigned int rtqueue_mark(rtqueue_t *rtq);
+void rtqueue_seek(rtqueue_t *rtq, unsigned int mark);
+
+/* blocking, for the disk side */
 int rtqueue_enq(rtqueue_t *rtq, float data);
 
 float rtqueue_deq(rtqueue_t *rtq);
 
+int rtqueue_wait_space(rtqueue_t *rtq, int n);
+int rtqueue_wait_records(rtqueue_t *rtq, int n);
+
+void rtqueue_wake(rtqueue_t *rtq);
+
 #endif
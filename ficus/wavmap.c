@@ -0,0 +1,335 @@
+/* wavmap.c
+This file is a part of 'ficus'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+memory mapped WAV reader, see wavmap.h
+
+Copyright 2014 murray foster */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "wavmap.h"
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+static unsigned int
+le16(const unsigned char *p)
+{
+  return p[0] | p[1] << 8;
+} /* le16 */
+
+static unsigned int
+le32(const unsigned char *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+} /* le32 */
+
+static int
+wavmap_parse(wavmap_t *wm)
+{
+  /* find the fmt and data chunks of the mapped file and check
+     it's a format we read. returns 0 if it is */
+  const unsigned char *p = wm->map;
+  const unsigned char *end = p + wm->map_size;
+  const unsigned char *fmt = NULL;
+  unsigned int size, tag, bits;
+  long bytes = 0;
+
+  if( (wm->map_size < 12) || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4) )
+    return 1;
+
+  for( p += 12; p + 8 <= end; p += 8 + size + (size & 1) )
+    {
+      size = le32(p + 4);
+      if( !memcmp(p, "fmt ", 4) && (size >= 16) && (p + 8 + size <= end) )
+	fmt = p + 8;
+      else if( !memcmp(p, "data", 4) )
+	{
+	  wm->data = p + 8;
+	  /* files still being written, or longer than 4GB,
+	     don't always say how long their data is */
+	  bytes = end - wm->data;
+	  if( (size != 0) && (size < bytes) )
+	    bytes = size;
+	  break;
+	}
+    }
+
+  if( (fmt == NULL) || (wm->data == NULL) )
+    return 1;
+
+  tag = le16(fmt);
+  wm->channels = le16(fmt + 2);
+  wm->samplerate = le32(fmt + 4);
+  bits = le16(fmt + 14);
+
+  /* the real format of an extensible file is in its subformat */
+  if( (tag == WAVE_FORMAT_EXTENSIBLE) && (le32(fmt - 4) >= 40) )
+    tag = le16(fmt + 24);
+
+  if( (tag == WAVE_FORMAT_PCM) && (bits == 16) )
+    wm->format = WAVMAP_PCM16;
+  else if( (tag == WAVE_FORMAT_PCM) && (bits == 24) )
+    wm->format = WAVMAP_PCM24;
+  else if( (tag == WAVE_FORMAT_PCM) && (bits == 32) )
+    wm->format = WAVMAP_PCM32;
+  else if( (tag == WAVE_FORMAT_IEEE_FLOAT) && (bits == 32) )
+    wm->format = WAVMAP_FLOAT;
+  else
+    return 1;
+
+  if( wm->channels < 1 )
+    return 1;
+
+  wm->stride = wm->channels * bits / 8;
+  wm->frames = bytes / wm->stride;
+
+  return 0;
+} /* wavmap_parse */
+
+wavmap_t *
+wavmap_open(const char *path)
+{
+  wavmap_t *wm;
+  struct stat sb;
+  int fd;
+
+#if !defined(__BYTE_ORDER__) || (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+  /* samples are read straight out of the mapping, which only
+     works on hosts with WAV's byte order */
+  return NULL;
+#endif
+
+  if( (fd = open(path, O_RDONLY)) < 0 )
+    return NULL;
+
+  if( (fstat(fd, &sb) < 0) || (sb.st_size == 0) ||
+      ((wm = calloc(1, sizeof(wavmap_t))) == NULL) )
+    {
+      close(fd);
+      return NULL;
+    }
+
+  wm->map_size = sb.st_size;
+  wm->map = mmap(NULL, wm->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  /* the mapping keeps the file open */
+  close(fd);
+
+  if( (wm->map == MAP_FAILED) || wavmap_parse(wm) )
+    {
+      if( wm->map != MAP_FAILED )
+	munmap(wm->map, wm->map_size);
+      free(wm);
+      return NULL;
+    }
+
+  return wm;
+} /* wavmap_open */
+
+void
+wavmap_close(wavmap_t *wm)
+{
+  if( wm == NULL )
+    return;
+
+  munmap(wm->map, wm->map_size);
+  free(wm);
+} /* wavmap_close */
+
+void
+wavmap_prefetch(wavmap_t *wm, long pos, long nframes)
+{
+  /* madvise() wants whole pages */
+  long page = sysconf(_SC_PAGESIZE);
+  long first, last;
+
+  if( pos < 0 )
+    {
+      nframes += pos;
+      pos = 0;
+    }
+  if( nframes > wm->frames - pos )
+    nframes = wm->frames - pos;
+  if( nframes <= 0 )
+    return;
+
+  first = (wm->data - (const unsigned char *) wm->map) + pos * wm->stride;
+  last = first + nframes * wm->stride;
+  first -= first % page;
+
+  madvise((char *) wm->map + first, last - first, MADV_WILLNEED);
+} /* wavmap_prefetch */
+
+static long
+read_pcm16(const unsigned char *p, int stride, float *buf, long nframes)
+{
+  /* mono and stereo files are converted 4 or 8 frames at once,
+     the first channel is the low half of every 32 bits of a
+     stereo frame */
+  long i = 0;
+  short s;
+
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps(1.0f / 32768);
+  __m128i v;
+
+  if( stride == 2 )
+    for( ; i + 8 <= nframes; i += 8 )
+      {
+	v = _mm_loadu_si128((const __m128i *) (p + i * 2));
+	_mm_storeu_ps(buf + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)), scale));
+	_mm_storeu_ps(buf + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)), scale));
+      }
+  else if( stride == 4 )
+    for( ; i + 4 <= nframes; i += 4 )
+      {
+	v = _mm_loadu_si128((const __m128i *) (p + i * 4));
+	_mm_storeu_ps(buf + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(v, 16), 16)), scale));
+      }
+#endif
+
+  for( ; i < nframes; i++ )
+    {
+      memcpy(&s, p + i * stride, sizeof(s));
+      buf[i] = s * (1.0f / 32768);
+    }
+
+  return nframes;
+} /* read_pcm16 */
+
+static inline int
+le32_at(const unsigned char *p)
+{
+  int s;
+
+  memcpy(&s, p, sizeof(s));
+  return s;
+} /* le32_at */
+
+static long
+read_pcm24(const unsigned char *p, int stride, float *buf, long nframes)
+{
+  /* 4 frames at once whatever the channel count. the first
+     channel of a frame, read as 32 bits and shifted up a byte,
+     is the sample scaled to a full int. the read takes a byte
+     of the next frame along, so the last frame goes the slow
+     way */
+  long i = 0;
+
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  __m128i v;
+
+  for( ; i + 4 < nframes; i += 4 )
+    {
+      v = _mm_set_epi32(le32_at(p + (i + 3) * stride), le32_at(p + (i + 2) * stride),
+			le32_at(p + (i + 1) * stride), le32_at(p + i * stride));
+      _mm_storeu_ps(buf + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_slli_epi32(v, 8)), scale));
+    }
+#endif
+
+  for( ; i < nframes; i++ )
+    buf[i] = ((int) ((unsigned) p[i * stride] << 8 | (unsigned) p[i * stride + 1] << 16 |
+		     (unsigned) p[i * stride + 2] << 24) >> 8) * (1.0f / 8388608);
+
+  return nframes;
+} /* read_pcm24 */
+
+static long
+read_pcm32(const unsigned char *p, int stride, float *buf, long nframes)
+{
+  /* 4 frames at once whatever the channel count */
+  long i = 0;
+
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  __m128i v;
+
+  for( ; i + 4 <= nframes; i += 4 )
+    {
+      v = _mm_set_epi32(le32_at(p + (i + 3) * stride), le32_at(p + (i + 2) * stride),
+			le32_at(p + (i + 1) * stride), le32_at(p + i * stride));
+      _mm_storeu_ps(buf + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+    }
+#endif
+
+  for( ; i < nframes; i++ )
+    buf[i] = le32_at(p + i * stride) * (1.0f / 2147483648.0f);
+
+  return nframes;
+} /* read_pcm32 */
+
+static long
+read_float(const unsigned char *p, int stride, float *buf, long nframes)
+{
+  /* mono float files need no converting at all, the first
+     channel of stereo ones is every other float */
+  long i = 0;
+
+  if( stride == sizeof(float) )
+    {
+      memcpy(buf, p, nframes * sizeof(float));
+      return nframes;
+    }
+
+#ifdef __SSE2__
+  if( stride == 2 * sizeof(float) )
+    for( ; i + 4 <= nframes; i += 4 )
+      _mm_storeu_ps(buf + i, _mm_shuffle_ps(_mm_loadu_ps((const float *) (p + i * 8)),
+					    _mm_loadu_ps((const float *) (p + i * 8 + 16)),
+					    _MM_SHUFFLE(2, 0, 2, 0)));
+#endif
+
+  for( ; i < nframes; i++ )
+    memcpy(buf + i, p + i * stride, sizeof(float));
+
+  return nframes;
+} /* read_float */
+
+long
+wavmap_read(wavmap_t *wm, long pos, float *buf, long nframes)
+{
+  const unsigned char *p;
+
+  if( (pos < 0) || (pos >= wm->frames) )
+    return 0;
+  if( nframes > wm->frames - pos )
+    nframes = wm->frames - pos;
+
+  p = wm->data + pos * wm->stride;
+
+  switch( wm->format )
+    {
+    case WAVMAP_PCM16:
+      return read_pcm16(p, wm->stride, buf, nframes);
+    case WAVMAP_FLOAT:
+      return read_float(p, wm->stride, buf, nframes);
+    case WAVMAP_PCM24:
+      return read_pcm24(p, wm->stride, buf, nframes);
+    case WAVMAP_PCM32:
+      return read_pcm32(p, wm->stride, buf, nframes);
+    }
+
+  return nframes;
+} /* wavmap_read */
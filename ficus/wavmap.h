@@ -0,0 +1,91 @@
+/* wavmap.h
+This file is a part of 'ficus'
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+'wavmap' reads plain RIFF WAV files, 16/24/32-bit PCM or 32-bit
+float, straight out of a memory mapping of the file.  frames are
+converted to float as they're asked for, from the first channel
+only, so a soundfile that's in the page cache plays without a
+single read() and without being copied anywhere first.
+
+anything else (other containers, compressed or 8-bit data, big
+endian hosts) isn't opened, the caller goes thru libsndfile
+instead.  reads never block on anything but the page cache and
+never allocate.
+
+Copyright 2014 murray foster */
+
+#ifndef wavmap_h__
+#define wavmap_h__
+
+#include <string.h>
+
+#define WAVMAP_PCM16 0
+#define WAVMAP_PCM24 1
+#define WAVMAP_PCM32 2
+#define WAVMAP_FLOAT 3
+
+typedef struct wavmap
+{
+  /* the whole file as it's mapped */
+  void *map;
+  long map_size;
+  /* first byte of the data chunk */
+  const unsigned char *data;
+  long frames;
+  int channels;
+  int samplerate;
+  int format;
+  /* bytes from one frame to the next */
+  int stride;
+} wavmap_t;
+
+/* map a soundfile, NULL if it isn't a WAV file wavmap reads */
+wavmap_t *wavmap_open(const char *path);
+void wavmap_close(wavmap_t *wm);
+
+/* convert nframes of the first channel from frame 'pos' on into
+   buf, returns how many there were before the end of the file */
+long wavmap_read(wavmap_t *wm, long pos, float *buf, long nframes);
+
+/* start reading nframes from frame 'pos' on into the page
+   cache in the background, returns straight away */
+void wavmap_prefetch(wavmap_t *wm, long pos, long nframes);
+
+/* the first channel of frame 'pos', which has to exist */
+static inline float
+wavmap_frame(wavmap_t *wm, long pos)
+{
+  const unsigned char *p = wm->data + pos * wm->stride;
+  short s;
+  int i;
+  float f;
+
+  switch( wm->format )
+    {
+    case WAVMAP_PCM16:
+      memcpy(&s, p, sizeof(s));
+      return s * (1.0f / 32768);
+    case WAVMAP_PCM24:
+      return ((int) ((unsigned) p[0] << 8 | (unsigned) p[1] << 16 |
+		     (unsigned) p[2] << 24) >> 8) * (1.0f / 8388608);
+    case WAVMAP_PCM32:
+      memcpy(&i, p, sizeof(i));
+      return i * (1.0f / 2147483648.0f);
+    default:
+      memcpy(&f, p, sizeof(f));
+      return f;
+    }
+} /* wavmap_frame */
+
+#endif
@@ -18,6 +18,7 @@ Copyright 2014 murray foster */
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <unistd.h>
 #include <monome.h>
 #include <jack/jack.h>
 #include <alsa/asoundlib.h>
@@ -142,8 +143,6 @@ int playback_modifiers_enable[48]={0};
 */
 float playback_modifiers[48][3]={{0}};
 
-int signal_playback_trigger[48] = {0};
-
 /* these variables are for automagically hooking up monome */
 char *monome_name;
 char *monome_name_user_defined="init";
@@ -158,6 +157,16 @@ char *osc_port_out = NULL;
 
 /* button state used to indicate if we are accepting internal clock signal */
 int external_clock_enable = 0;
+/* FICUS_SYNC_* mode of the sequencer, '-js' on the command line */
+int jack_sync = FICUS_SYNC_INTERNAL;
+/* seconds between engine statistics pushed over osc, 0 never */
+int stats_interval = 0;
+/* '-lt' on the command line, time triggers from press to sound */
+int latency_mode = 0;
+/* '-po' on the command line, triggers of a bank that may overlap */
+int polyphony = 1;
+/* when the button handle_press() is handling went down */
+unsigned long long press_ingress = 0;
 
 void
 managed_led_on(monome_t *monome, int x, int y)
@@ -401,6 +410,30 @@ int candor_playback(int samplenum)
 
 }/* candor_playback */
 
+int candor_schedule_playback(int samplenum, unsigned int frame)
+{
+  /* like candor_playback(), but libficus starts the bank on
+     JACK frame 'frame' from inside its process() callback.
+     the envelope changes on that frame too, not under the
+     voice that's still playing */
+  float speed=1, rampup=0.0, rampdown=0.0;
+
+  if(playback_modifiers_enable[samplenum])
+    {
+      speed=playback_modifiers[samplenum][0];
+      rampup=playback_modifiers[samplenum][1];
+      rampdown=playback_modifiers[samplenum][2];
+    }
+
+  if( ficus_schedule(frame, FICUS_EVENT_RAMPUP, samplenum, 0, rampup) ||
+      ficus_schedule(frame, FICUS_EVENT_RAMPDOWN, samplenum, 0, rampdown) ||
+      ficus_schedule(frame, FICUS_EVENT_SPEED, samplenum, 0, speed) ||
+      ficus_schedule(frame, FICUS_EVENT_TRIGGER, samplenum, 0, 0) )
+    fprintf(stderr, "candor: too many events waiting, bank %d dropped\n", samplenum);
+
+  return 0;
+}/* candor_schedule_playback */
+
 int
 sampler_page_chooser(const monome_event_t *e, int button)
 {
@@ -433,6 +466,7 @@ sampler_page_chooser(const monome_event_t *e, int button)
 	  playback_modifiers[button][0]=sampler_playback_speed;
 	  if( playback_reverse )
 	    playback_modifiers[button][0]*=-1;
+	  ficus_latency_ingress(button, FICUS_LATENCY_PATH_MONOME, press_ingress);
 	  candor_playback(button);
 	}
       break;
@@ -481,17 +515,10 @@ sampler_page_chooser(const monome_event_t *e, int button)
 	    
 	    ficus_capturef(button, finallimit);
 	    sampler_capture_leds[0][button]=0;
-	    /* we have to wait to load this sample until we're
-	       done recording so we add a check for it in our 
-	       state_manager() and wait on it */
-	    
-	    /* WE NEED TO WRITE THE NEW SOUNDFILE TO A TEMPORARY
-	       FILE AND THEN REPLACE IT WHEN DONE RECORDING USING
-	       A FILESYSTEM OPERATION SO WE AVOID PLAYBACK OF 
-	       AUDIO THAT'S NOT FINISHED CAPTURING.  THIS IS TO
-	       BE DONE (PROBABLY) IN libficus.c 
-	        
-               ^^badly worded, but you'll remember (looping) */
+	    /* libficus captures to a temporary file and hands the
+	       audio to this bank once it's done recording, we add a
+	       check for it in our state_manager() so a looping bank
+	       starts playing it right away */
 
 	    sampler_capture_loadcheck[button]=1;
 	    sampler_capture_armed_count = sampler_capture_armed_count - 1;
@@ -631,6 +658,9 @@ handle_press(const monome_event_t *e, void *data)
 {
   unsigned int x, y, x2, y2, button, c;
 
+  if( latency_mode )
+    press_ingress = ficus_latency_clock();
+
   x = e->grid.x;
   y = e->grid.y;
 
@@ -1236,18 +1266,9 @@ button_to_coordinate(monome_t *monome, int button, int xmod, int ymod, void (*fu
 		    (*funcptr_led)(monome, button-56+xmod, 7+ymod);
 } /* button_to_coordinate */
 
-void
-sample_playback_trigger (int sample_num)
-{
-  candor_playback(sample_num);
-  return;
-} /* sample_playback_trigger */
-
 void
 state_change(monome_t *monome, int x, int y)
 {
-  char tempstring[100] = {0};
-
   /* monitors state changes of our audio engine
    and takes action when it needs to */
 
@@ -1261,11 +1282,6 @@ state_change(monome_t *monome, int x, int y)
   else
     sampler_page_leds[bank] = 1;
 
-  if( signal_playback_trigger[bank] ) {
-    sample_playback_trigger(bank);
-    signal_playback_trigger[bank] = 0;
-  }
-
   /* looping */
   if( !ficus_islooping(bank) )
     sampler_loop_leds[bank] = 0;
@@ -1280,13 +1296,11 @@ state_change(monome_t *monome, int x, int y)
     }
   else
     {
-      /* if we aren't capturing to bank, load new soundfile
-	 and turn off corresponding LED */
+      /* if we aren't capturing to bank, turn off corresponding 
+	 LED. libficus already made the captured audio the bank's
+	 soundfile when capturing finished */
       if( sampler_capture_loadcheck[bank] )
 	{
-	  /* load the sample after capturing is finished */
-	  snprintf(tempstring, 100, "%s/%s%d.wav", sampler_path, sampler_prefix, bank);
-	  ficus_loadfile(tempstring, bank);
 	  sampler_capture_loadcheck[bank]=0;
 	  /* if the sample is set to loop, we immediately
 	     begin playback */
@@ -1314,8 +1328,10 @@ playhead_nextstep(monome_t *monome)
     seq_playhead=0;
 } /* playhead_nextstep */
 
-void trigger_step_playback(int step)
+void trigger_step_playback(int step, unsigned int frame)
 {
+  /* every voice on this step starts on JACK frame 'frame',
+     straight from libficus' process() callback */
   int i,c,j;
 
   if( step<8 )
@@ -1340,7 +1356,7 @@ void trigger_step_playback(int step)
       j=step+(c*8)-(i*8);
       if( (sequencer_voice_leds[i][j]) &&
 	  (sequencer_voice_map[i][j]) )
-	signal_playback_trigger[sequencer_voice_map[i][j]-1] = 1;
+	candor_schedule_playback(sequencer_voice_map[i][j]-1, frame);
     }
 }/* trigger_step_playback */
 
@@ -1350,15 +1366,58 @@ lo_address get_outgoing_osc_addr()
   return lo_address_new("127.0.0.1",osc_port_out);
 } /* get_outgoing_osc_addr */
 
-void trigger_step(int step)
+void announce_step(int step)
 {
   lo_address lo_addr_send = get_outgoing_osc_addr();
-  trigger_step_playback(step);
 
   if( external_clock_enable == 0 )
     if (lo_send(lo_addr_send,"/serialosc/clock","i",step) == -1 )
       fprintf(stderr,"ERROR sending message /candor/clock %d\n", step);
 
+} /* announce_step */
+
+void announce_stats()
+{
+  /* send libficus' statistics to the outgoing osc port, one
+     /candor/stats message for the engine and a /candor/stats/bank
+     one for every bank streaming from disk or that ever ran
+     short of audio. the timings start over every time */
+  lo_address lo_addr_send = get_outgoing_osc_addr();
+  ficus_stats_t stats;
+  int bank;
+
+  ficus_get_stats(&stats, 1);
+  if (lo_send(lo_addr_send,"/candor/stats","iffffiiii",
+	      (int)stats.periods, stats.dsp_min, stats.dsp_avg, stats.dsp_max,
+	      stats.dsp_peak, (int)stats.xruns, (int)stats.underruns,
+	      (int)stats.capture_drops, stats.voices) == -1 )
+    fprintf(stderr,"ERROR sending message /candor/stats\n");
+
+  for( bank=0; bank < ficus_numbanks(); bank++ )
+    if( ficus_queue_fill(bank) || ficus_underruns(bank) )
+      lo_send(lo_addr_send,"/candor/stats/bank","iii", bank,
+	      ficus_queue_fill(bank), (int)ficus_underruns(bank));
+
+  lo_address_free(lo_addr_send);
+} /* announce_stats */
+
+void *
+stats_thread(void *arg)
+{
+  /* push the statistics every stats_interval seconds */
+  while(1)
+    {
+      sleep(stats_interval);
+      announce_stats();
+    }
+
+  return NULL;
+} /* stats_thread */
+
+void trigger_step(int step)
+{
+  trigger_step_playback(step, ficus_frame_time());
+  announce_step(step);
 } /* trigger_step */
 
 void
@@ -1422,42 +1481,56 @@ tap_recorder(monome_t *monome)
 void
 metronome(monome_t *monome)
 {
-  int ms = 0;
+  /* libficus' transport counts the steps off in JACK frames.
+     each step's voices are scheduled on its exact frame while
+     the step before it plays, the LEDs and the clock message
+     only follow once it has played */
+  unsigned int next_frame;
+  int scheduled = -1;
+  int passed;
+  /* following JACK, we only know where a beat lands once
+     the one before it went by */
+  int primed = (jack_sync == FICUS_SYNC_INTERNAL);
   void (*funcptr_led_change)(monome_t *monome, int, int);
 
+  next_frame = ficus_transport_start(seq_bpm);
+
   while( external_clock_enable==0 )
     {
-      if( !sequencer_transport_led)
+      if( !sequencer_transport_led && primed &&
+	  (!tap_recorder_leds[0] || !tap_recorder_leds[1]) &&
+	  (scheduled < 0) )
 	{
-	  /* bpm=some_stored_bpm; */
-	  if(!tap_recorder_leds[0] || !tap_recorder_leds[1])
-	    {
-	      
-	      if( sequencer_page_pos[0]==1 )
-		{
-		  funcptr_led_change=&playhead_led_refresh;
-		  button_to_coordinate(monome, seq_playhead, 0, 0, funcptr_led_change);
-		}
-	      
-	      trigger_step(seq_playhead);
-	      
-	      ms=(60.0f / (float)seq_bpm) * 1000 * 1000;
-	      usleep(ms);
-	      seq_playhead+=1;
-	      if(seq_playhead==48)
-		seq_playhead=0;
-	    }
-	  if(tap_recorder_leds[2])
-	    return;
+	  trigger_step_playback(seq_playhead, next_frame);
+	  scheduled = seq_playhead;
 	}
-      else
+
+      passed = ficus_transport_wait(&next_frame);
+      ficus_transport_tempo(seq_bpm);
+      if( !passed )
+	continue;
+      primed = 1;
+
+      funcptr_led_change=&playhead_led_refresh;
+      if( scheduled >= 0 )
 	{
-	  funcptr_led_change=&playhead_led_refresh;
-	  button_to_coordinate(monome, seq_playhead, 0, 0, funcptr_led_change);
-	  ms=(60.0f / (float)seq_bpm) * 1000 * 1000;
-	  usleep(ms);
+	  /* the step we scheduled has played */
+	  if( sequencer_page_pos[0]==1 )
+	    button_to_coordinate(monome, scheduled, 0, 0, funcptr_led_change);
+	  announce_step(scheduled);
+
+	  seq_playhead=(scheduled+passed)%48;
+	  scheduled = -1;
 	}
+      else
+	/* stopped, keep the playhead blinking */
+	button_to_coordinate(monome, seq_playhead, 0, 0, funcptr_led_change);
+
+      if(tap_recorder_leds[2])
+	break;
     }
+
+  ficus_transport_stop();
 } /* metronome */
 
 void
@@ -1863,17 +1936,10 @@ trigger_active_capture_samples()
 	
 	ficus_capturef(bank, finallimit);
 	sampler_capture_leds[0][bank]=0;
-	/* we have to wait to load this sample until we're
-	   done recording so we add a check for it in our 
-	   state_manager() and wait on it */
-	
-	/* WE NEED TO WRITE THE NEW SOUNDFILE TO A TEMPORARY
-	   FILE AND THEN REPLACE IT WHEN DONE RECORDING USING
-	   A FILESYSTEM OPERATION SO WE AVOID PLAYBACK OF 
-	   AUDIO THAT'S NOT FINISHED CAPTURING.  THIS IS TO
-	   BE DONE (PROBABLY) IN libficus.c 
-	   
-	   ^^badly worded, but you'll remember (looping) */
+	/* libficus captures to a temporary file and hands the
+	   audio to this bank once it's done recording, we add a
+	   check for it in our state_manager() so a looping bank
+	   starts playing it right away */
 	
 	sampler_capture_loadcheck[bank]=1;
       }
@@ -1975,8 +2041,9 @@ setup_candor(monome_t *monome, char *name, char *path, char *prefix,
   /* sets default state of candor */
   init_default_state(monome);
 
-  /* libficus setup */
-  if (ficus_setup(name, path, prefix, bitdepth) == 1)
+  /* libficus setup, candor's grid has 6 rows of 8 banks 
+     and 8 in/out channels */
+  if (ficus_setup(name, path, prefix, bitdepth, 48, 8) == 1)
    {
      fprintf(stderr, "candor: libficus setup failed.\n");
      return;
@@ -2113,6 +2180,26 @@ int osc_loop_handler(const char *path, const char *types, lo_arg ** argv,
   return 0;
 } /* osc_load_handler */
 
+int osc_looppoints_handler(const char *path, const char *types, lo_arg ** argv,
+			   int argc, void *data, void *user_data)
+{
+  int samplenum;
+  fprintf(stdout, "path: <%s>\n", path);
+  samplenum=argv[0]->i;
+  ficus_loop_points(samplenum,argv[1]->i,argv[2]->i);
+  return 0;
+} /* osc_looppoints_handler */
+
+int osc_loopfade_handler(const char *path, const char *types, lo_arg ** argv,
+			 int argc, void *data, void *user_data)
+{
+  int samplenum;
+  fprintf(stdout, "path: <%s>\n", path);
+  samplenum=argv[0]->i;
+  ficus_loop_fade(samplenum,argv[1]->i);
+  return 0;
+} /* osc_loopfade_handler */
+
 int osc_setmixout_handler(const char *path, const char *types, lo_arg ** argv,
 			  int argc, void *data, void *user_data)
 {
@@ -2153,6 +2240,7 @@ int osc_jackmonitor_handler(const char *path, const char *types, lo_arg ** argv,
 int osc_playback_handler(const char *path, const char *types, lo_arg ** argv,
 			 int argc, void *data, void *user_data)
 {
+  unsigned long long ingress = ficus_latency_clock();
   int i;
   fprintf(stdout,"path: <%s>\n", path);
   for (i = 0; i < argc; i++) {
@@ -2161,6 +2249,7 @@ int osc_playback_handler(const char *path, const char *types, lo_arg ** argv,
   }
   int button=0;
   button=argv[0]->i;
+  ficus_latency_ingress(button, FICUS_LATENCY_PATH_OSC, ingress);
   ficus_playback(button);
   return 0;
 } /* osc_playback_handler */
@@ -2284,10 +2373,40 @@ int osc_islooping_handler(const char *path, const char *types, lo_arg ** argv,
   return 0;
 } /* osc_islooping_handler */
 
+int osc_stats_handler(const char *path, const char *types, lo_arg ** argv, 
+		      int argc, void *data, void *user_data) {
+  announce_stats();
+  return 0;
+} /* osc_stats_handler */
+
+void
+print_latency()
+{
+  /* the trigger latency histograms as CSV, one line per 
+     bucket that counted anything. bucket_us is its upper
+     bound. JACK's own output latency comes on top of 'output' */
+  char *paths[] = {"monome", "osc", "midi", "other"};
+  char *hops[] = {"dispatch", "apply", "enqueue", "dequeue", "output"};
+  unsigned long buckets[FICUS_LATENCY_BUCKETS];
+  int path, hop, b;
+
+  if( !latency_mode )
+    return;
+
+  fprintf(stdout,"path,hop,bucket_us,count\n");
+  for( path=0; path < FICUS_LATENCY_PATHS; path++ )
+    for( hop=0; hop < FICUS_LATENCY_HOPS; hop++ )
+      if( ficus_latency_histogram(path, hop, buckets) )
+	for( b=0; b < FICUS_LATENCY_BUCKETS; b++ )
+	  if( buckets[b] )
+	    fprintf(stdout,"%s,%s,%lu,%lu\n", paths[path], hops[hop], 1UL << b, buckets[b]);
+} /* print_latency */
+
 int quit_candor(monome_t *monome) {
   /* clean-up */
   fprintf(stdout, "Closing monome...\n");
   monome_close(monome);
+  print_latency();
   fprintf(stdout, "Cleaning up ficus...\n");
   ficus_clean();
   fprintf(stdout, "Flushing stdout...\n");
@@ -2299,6 +2418,7 @@ int osc_quit_handler(const char *path, const char *types, lo_arg ** argv,
 		     int argc, void *data, void *user_data)
 {
   fprintf(stdout,"quitting\n\n");
+  print_latency();
     /* clean-up */
   ficus_clean();
   fflush(stdout);
@@ -2320,7 +2440,11 @@ print_usage() {
 	  " -b,  --bitdepth      set bitdepth of capture to 8,16,24,32,64, or 128. default: 24\n"
 	  " -pa, --path          set directory of where to store captured sounds. default: 'samples/'\n"
 	  " -pr, --prefix        set prefix name for all captured sounds. default: 'sample'\n"
-	  " -f,  --file          set path of session file to load preexisting sounds.\n\n"
+	  " -f,  --file          set path of session file to load preexisting sounds.\n"
+	  " -js, --jack-sync     step the sequencer on JACK transport beats, 'follow' or 'master'\n"
+	  " -st, --stats         send engine statistics over osc every n seconds. default: 0 (only on /candor/stats)\n"
+	  " -po, --polyphony     how many triggers of a bank may ring over each other. default: 1\n"
+	  " -lt, --latency       time every trigger from button press or osc message to sound, printed on exit\n\n"
           "documentation available soon\n\n");
   exit(0);
 
@@ -2431,6 +2555,35 @@ main(int argc, char *argv[])
 	    file_path=store_input;
 	  }
 
+	  if( !strcmp(store_flag,"-js") ||
+	      !strcmp(store_flag,"--jack-sync")) {
+	    store_input = argv[c+1];
+	    if( store_input && !strcmp(store_input,"master") )
+	      jack_sync=FICUS_SYNC_MASTER;
+	    else if( store_input && !strcmp(store_input,"follow") )
+	      jack_sync=FICUS_SYNC_FOLLOW;
+	    else {
+	      fprintf(stderr,"%s takes 'follow' or 'master'\n\n", store_flag);
+	      print_usage();
+	    }
+	  }
+
+	  if( !strcmp(store_flag,"-st") ||
+	      !strcmp(store_flag,"--stats")) {
+	    store_input = argv[c+1];
+	    stats_interval=atoi(store_input);
+	  }
+
+	  if( !strcmp(store_flag,"-po") ||
+	      !strcmp(store_flag,"--polyphony")) {
+	    store_input = argv[c+1];
+	    polyphony=atoi(store_input);
+	  }
+
+	  if( !strcmp(store_flag,"-lt") ||
+	      !strcmp(store_flag,"--latency"))
+	    latency_mode=1;
+
 	  if( !strcmp(store_flag,"-cc"))
 	    connchan=1;
 	  
@@ -2527,6 +2680,8 @@ main(int argc, char *argv[])
   /* add method that will match the path /quit with no args */
   lo_server_thread_add_method(st, "/candor/load", "si", osc_load_handler, NULL);
   lo_server_thread_add_method(st, "/candor/loop", "ii", osc_loop_handler, NULL);
+  lo_server_thread_add_method(st, "/candor/looppoints", "iii", osc_looppoints_handler, NULL);
+  lo_server_thread_add_method(st, "/candor/loopfade", "ii", osc_loopfade_handler, NULL);
   lo_server_thread_add_method(st, "/candor/setmixout", "iii", osc_setmixout_handler, NULL);
   lo_server_thread_add_method(st, "/candor/setmixin", "iii", osc_setmixin_handler, NULL);
   lo_server_thread_add_method(st, "/candor/jackmonitor", "iii", osc_jackmonitor_handler, NULL);
@@ -2543,6 +2698,7 @@ main(int argc, char *argv[])
   lo_server_thread_add_method(st, "/candor/isplaying", "i", osc_isplaying_handler, NULL);
   lo_server_thread_add_method(st, "/candor/iscapturing", "i", osc_iscapturing_handler, NULL);
   lo_server_thread_add_method(st, "/candor/islooping", "i", osc_islooping_handler, NULL);
+  lo_server_thread_add_method(st, "/candor/stats", NULL, osc_stats_handler, NULL);
   lo_server_thread_add_method(st, "/candor/quit", NULL, osc_quit_handler, NULL);
   lo_server_thread_add_method(st, "/candor/clock", NULL, osc_external_clock_handler, NULL);
   lo_server_thread_start(st);
@@ -2574,9 +2730,27 @@ main(int argc, char *argv[])
   if( connchan )
     ficus_connect_channels(8,8);
 
+  if( ficus_transport_sync(jack_sync) )
+    fprintf(stderr, "candor: another client is JACK's timebase master already.\n");
+
+  if( latency_mode )
+    ficus_latency(1);
+
+  /* rolls and stutters from the sequencer let the last hit ring */
+  if( polyphony > 1 )
+    for( c=0; c < ficus_numbanks(); c++ )
+      ficus_polyphony(c, polyphony);
+
   pthread_t monome_thread_id;
   pthread_create(&monome_thread_id, NULL, monome_thread, monome);
   pthread_detach(&monome_thread_id);
+
+  if( stats_interval > 0 )
+    {
+      pthread_t stats_thread_id;
+      pthread_create(&stats_thread_id, NULL, stats_thread, NULL);
+      pthread_detach(stats_thread_id);
+    }
   
   printf("press <ENTER> to quit\n\n");
 
@@ -2594,6 +2768,7 @@ main(int argc, char *argv[])
 
   /* clean-up */
   monome_close(monome);
+  print_latency();
   ficus_clean();
 
   return 0;